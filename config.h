@@ -42,10 +42,33 @@
 #endif
 #define CONFIG_Z_STEPS_PER_MM 32.80839895 //microsteps/mm
 #define CONFIG_PULSE_MICROSECONDS 5
+#define CONFIG_SENSE_DEBOUNCE_MICROSECONDS 1000 // sensor changes count once stable this long, up to 2000, limits trigger at once
+#define CONFIG_AMASS_LEVELS 3  // smoother multi-axis steps at low rates, stepping up to 2^levels times the step rate, 0 disables
 #define CONFIG_FEEDRATE 8000.0 // in millimeters per minute
 #define CONFIG_SEEKRATE 8000.0
 #define CONFIG_ACCELERATION 1200000.0 // mm/min^2, typically 1000000-8000000, divide by (60*60) to get mm/sec^2
 #define CONFIG_JUNCTION_DEVIATION 0.006 // mm
+// #define CONFIG_S_CURVE  // jerk-limited (smoothstep) speed changes, peak acceleration is 1.5x CONFIG_ACCELERATION
+// #define CONFIG_INPUT_SHAPER 1  // cancel gantry resonance by shaping speed changes, 1: ZV, 2: ZVD
+#define CONFIG_SHAPER_FREQUENCY 40.0 // Hz, resonance to cancel, at least 7Hz for ZV, 14Hz for ZVD
+#define CONFIG_SHAPER_DAMPING 0.1 // damping ratio of the resonance
+// #define CONFIG_STEP_TIMED_RAMPS  // time every step of accelerations exactly (AVR446), not with CONFIG_S_CURVE or CONFIG_INPUT_SHAPER
+#define CONFIG_COALESCE_TOLERANCE 0.005 // mm, max path deviation when merging collinear lines, 0.0 disables
+// #define CONFIG_JUNCTION_CURVATURE  // junction speeds of tessellated curves from their estimated radius
+#define CONFIG_CURVATURE_MAX_ANGLE 0.35 // rad, junctions turning more are always treated as corners
+#define CONFIG_MIN_SEGMENT_TIME 20000 // us, lines are slowed down to take this long when the buffer runs low
+#define CONFIG_HOMING_SEEKRATE 3000.0 // mm/min, fast approach of the limit switches
+#define CONFIG_HOMING_FEEDRATE 180.0 // mm/min, slow locate, home is where the switch releases at this rate
+#define CONFIG_HOMING_TRAVEL 2000.0 // mm, longest seek, more than the travel of any axis
+#define CONFIG_HOMING_PULLOFF 5.0 // mm, longest move off a pressed switch
+// #define CONFIG_HOMING_Z  // home the z axis on its Z1 switch before x and y, DRIVEBOARD only
+// #define CONFIG_SOFT_LIMITS  // reject lines leaving the bounds below, the job keeps running
+#define CONFIG_X_MIN 0.0     // mm, bounds of the soft limits from physical home
+#define CONFIG_X_MAX 1220.0  // mm
+#define CONFIG_Y_MIN 0.0     // mm
+#define CONFIG_Y_MAX 610.0   // mm
+#define CONFIG_Z_MIN 0.0     // mm
+#define CONFIG_Z_MAX 100.0   // mm
 #define CONFIG_X_ORIGIN_OFFSET 5.0  // mm, x-offset of table origin from physical home
 #define CONFIG_Y_ORIGIN_OFFSET 5.0  // mm, y-offset of table origin from physical home
 #define CONFIG_Z_ORIGIN_OFFSET 0.0   // mm, z-offset of table origin from physical home
@@ -160,8 +183,11 @@
 // slower than this value, except when sleeping. This parameter overrides the minimum planner speed.
 // This is primarily used to guarantee that the end of a movement is always reached and not stop to
 // never reach its target. This parameter should always be greater than zero.
-#define MINIMUM_STEPS_PER_MINUTE 1600U // (steps/min) - Integer value only
-// 1600 @ 32step_per_mm = 50mm/min
+// The step timer reaches down to 1 step/min (software postscaler), slow feeds run exactly.
+// Only rates below this one are rounded up to it. Decelerations to rest do not end at this
+// rate, steps left after their ramp reached 0 keep the rate of its last tick.
+#define MINIMUM_STEPS_PER_MINUTE 16U // (steps/min) - Integer value only
+// 16 @ 32step_per_mm = 0.5mm/min
   
 
 #define X_AXIS 0
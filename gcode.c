@@ -79,6 +79,7 @@ static volatile bool position_update_requested;  // make sure to update to stepp
 // prototypes for static functions (non-accesible from other files)
 static int next_statement(char *letter, double *double_ptr, char *line, uint8_t *char_counter);
 static int read_double(char *line, uint8_t *char_counter, double *double_ptr);
+static void print_sensor_status();
 
 
 void gcode_init() {
@@ -112,6 +113,15 @@ void gcode_process_line() {
   uint8_t print_extended_status = false;
 
   while ((numChars==0) || (chr != '\n')) {
+    while (!serial_available()) {
+      // keep the stepper supplied with segments while waiting for data
+      stepper_prepare_segments();
+      // report sensor changes right away, in between lines
+      if ((numChars == 0) && sense_changed()) {
+        print_sensor_status();
+        printString("\n");
+      }
+    }
     chr = serial_read();  // blocks until there is data
     if (numChars + 1 >= BUFFER_LINE_SIZE) {  // +1 for \0
       // reached line size, other side sent too long lines
@@ -124,16 +134,22 @@ void gcode_process_line() {
       rx_line[numChars++] = (char)chr;
     }
   }
+
+  // a steady stream never leaves the loop above waiting, top up the segments once per line
+  stepper_prepare_segments();
   
   //// process line
   if (numChars > 0) {          // Line is complete. Then execute!
     rx_line[numChars] = '\0';  // terminate string
     
     // handle position update after a stop
+    // the planner takes the same steps, the parser position maps back onto them exactly
     if (position_update_requested) {
-      gc.position[X_AXIS] = stepper_get_position_x();
-      gc.position[Y_AXIS] = stepper_get_position_y();
-      gc.position[Z_AXIS] = stepper_get_position_z();
+      int32_t steps[3];
+      stepper_get_position_steps(steps);
+      gc.position[X_AXIS] = steps[X_AXIS]/CONFIG_X_STEPS_PER_MM - gc.offsets[3*gc.offselect+X_AXIS];
+      gc.position[Y_AXIS] = steps[Y_AXIS]/CONFIG_Y_STEPS_PER_MM - gc.offsets[3*gc.offselect+Y_AXIS];
+      gc.position[Z_AXIS] = steps[Z_AXIS]/CONFIG_Z_STEPS_PER_MM - gc.offsets[3*gc.offselect+Z_AXIS];
       position_update_requested = false;
       //printString("gcode pos update\n");  // debug
     }
@@ -146,6 +162,8 @@ void gcode_process_line() {
         printString("P");  // Stop: Power Off
       } else if (status_code == STATUS_LIMIT_HIT) {
         printString("L");  // Stop: Limit Hit
+      } else if (status_code == STATUS_HOMING_FAILED) {
+        printString("F");  // Stop: Homing Failed, a switch was not found
       } else if (status_code == STATUS_SERIAL_STOP_REQUEST) {
         printString("R");  // Stop: Serial Request   
       } else if (status_code == STATUS_RX_BUFFER_OVERFLOW) {
@@ -225,6 +243,8 @@ void gcode_process_line() {
             printString("E");  // Warning: Expected command letter
           } else if (status_code == STATUS_UNSUPPORTED_STATEMENT) {
             printString("U");  // Warning: Unsupported statement   
+          } else if (status_code == STATUS_SOFT_LIMIT) {
+            printString("S");  // Warning: Soft limit, line out of bounds skipped
           } else {
             printString("W");  // Warning: Other error
             printInteger(status_code);        
@@ -235,44 +255,26 @@ void gcode_process_line() {
       }  
     }
 
-    #ifndef DEBUG_IGNORE_SENSORS
-      //// door and chiller status
-      if (SENSE_DOOR_OPEN) {
-        printString("D");  // Warning: Door is open
-      }
-      if (SENSE_CHILLER_OFF) {
-        printString("C");  // Warning: Chiller is off
-      }
-      #ifndef DRIVEBOARD
-        // power
-        if (SENSE_POWER_OFF) {
-          printString("P"); // Power Off
-        } 
-      #endif
-      // limit
-      if (SENSE_LIMITS) {
-        if (SENSE_X1_LIMIT) {
-          printString("L1");  // Limit X1 Hit
-        }
-        if (SENSE_X2_LIMIT) {
-          printString("L2");  // Limit X2 Hit
-        }
-        if (SENSE_Y1_LIMIT) {
-          printString("L3");  // Limit Y1 Hit
-        }
-        if (SENSE_Y2_LIMIT) {
-          printString("L4");  // Limit Y21 Hit
-        }
-      } 
-    #endif
+    if (stepper_hold_requested()) {
+      printString("H");  // Feed hold, resume with '~'
+    }
+
+    print_sensor_status();
 
     //
     if (print_extended_status) {   
       // position
+      int32_t steps[3];
+      stepper_get_position_steps(steps);
       printString("X");
-      printFloat(stepper_get_position_x());
+      printFloat(steps[X_AXIS]/CONFIG_X_STEPS_PER_MM);
       printString("Y");
-      printFloat(stepper_get_position_y());       
+      printFloat(steps[Y_AXIS]/CONFIG_Y_STEPS_PER_MM);       
+      // buffered motion time (ms) and free blocks
+      printString("Q");
+      printInteger(planner_queued_duration());
+      printString("A");
+      printInteger(planner_blocks_free());
       // version
       printPgmString(PSTR("V" LASAURGRBL_VERSION));
     }
@@ -390,18 +392,24 @@ uint8_t gcode_execute_line(char *line) {
   switch (next_action) {
     case NEXT_ACTION_SEEK:
       if (got_actual_line_command) {
-        planner_line( target[X_AXIS] + gc.offsets[3*gc.offselect+X_AXIS], 
-                      target[Y_AXIS] + gc.offsets[3*gc.offselect+Y_AXIS], 
-                      target[Z_AXIS] + gc.offsets[3*gc.offselect+Z_AXIS], 
-                      gc.seek_rate, 0 );
+        if (!planner_line( target[X_AXIS] + gc.offsets[3*gc.offselect+X_AXIS], 
+                           target[Y_AXIS] + gc.offsets[3*gc.offselect+Y_AXIS], 
+                           target[Z_AXIS] + gc.offsets[3*gc.offselect+Z_AXIS], 
+                           gc.seek_rate, 0 )) {
+          FAIL(STATUS_SOFT_LIMIT);  // line rejected, the position stays
+          return gc.status_code;
+        }
       }
       break;   
     case NEXT_ACTION_FEED:
       if (got_actual_line_command) {
-        planner_line( target[X_AXIS] + gc.offsets[3*gc.offselect+X_AXIS], 
-                      target[Y_AXIS] + gc.offsets[3*gc.offselect+Y_AXIS], 
-                      target[Z_AXIS] + gc.offsets[3*gc.offselect+Z_AXIS], 
-                      gc.feed_rate, gc.nominal_laser_intensity );                   
+        if (!planner_line( target[X_AXIS] + gc.offsets[3*gc.offselect+X_AXIS], 
+                           target[Y_AXIS] + gc.offsets[3*gc.offselect+Y_AXIS], 
+                           target[Z_AXIS] + gc.offsets[3*gc.offselect+Z_AXIS], 
+                           gc.feed_rate, gc.nominal_laser_intensity )) {
+          FAIL(STATUS_SOFT_LIMIT);  // line rejected, the position stays
+          return gc.status_code;
+        }
       }
       break; 
     case NEXT_ACTION_DWELL:
@@ -423,7 +431,10 @@ uint8_t gcode_execute_line(char *line) {
     //                 gc.seek_rate, 0 );
     //   break;
     case NEXT_ACTION_HOMING_CYCLE:
-      stepper_homing_cycle();
+      if (!stepper_homing_cycle()) {
+        // stopped, the position is not known to be home, it gets updated from the steppers
+        return gc.status_code;
+      }
       // now that we are at the physical home
       // zero all the position vectors
       clear_vector(gc.position);
@@ -492,6 +503,42 @@ uint8_t gcode_execute_line(char *line) {
 }
 
 
+// door, chiller, power and limit status letters
+static void print_sensor_status() {
+  sense_changed();  // any pending change is reported with this
+  #ifndef DEBUG_IGNORE_SENSORS
+    //// door and chiller status
+    if (SENSE_DOOR_OPEN) {
+      printString("D");  // Warning: Door is open
+    }
+    if (SENSE_CHILLER_OFF) {
+      printString("C");  // Warning: Chiller is off
+    }
+    #ifndef DRIVEBOARD
+      // power
+      if (SENSE_POWER_OFF) {
+        printString("P"); // Power Off
+      } 
+    #endif
+    // limit
+    if (SENSE_LIMITS) {
+      if (SENSE_X1_LIMIT) {
+        printString("L1");  // Limit X1 Hit
+      }
+      if (SENSE_X2_LIMIT) {
+        printString("L2");  // Limit X2 Hit
+      }
+      if (SENSE_Y1_LIMIT) {
+        printString("L3");  // Limit Y1 Hit
+      }
+      if (SENSE_Y2_LIMIT) {
+        printString("L4");  // Limit Y21 Hit
+      }
+    } 
+  #endif
+}
+
+
 void gcode_request_position_update() {
   position_update_requested = true;
 }
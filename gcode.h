@@ -37,6 +37,8 @@
 #define STATUS_POWER_OFF 9
 // #define STATUS_DOOR_OPEN 10
 // #define STATUS_CHILLER_OFF 11
+#define STATUS_HOMING_FAILED 12
+#define STATUS_SOFT_LIMIT 13
 
 
 // Initialize the parser
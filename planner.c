@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <util/delay.h>
 #include <string.h>
+#include <util/atomic.h>
 #include "planner.h"
 #include "stepper.h"
 #include "config.h"
@@ -29,116 +30,157 @@
 
 // The number of linear motions that can be in the plan at any give time
 #define BLOCK_BUFFER_SIZE 16  // do not make bigger than uint8_t
+// Below this many queued blocks new lines get stretched to CONFIG_MIN_SEGMENT_TIME
+#define SLOWDOWN_THRESHOLD (BLOCK_BUFFER_SIZE/2)
+// Number of blocks from the tail on that get their trapezoid calculated ahead of the stepper
+#define BLOCK_PREPARE_AHEAD 3
+// Soft limits in absolute steps, constants such that a line costs integer compares only
+#define X_MIN_STEPS ((int32_t)(CONFIG_X_MIN*CONFIG_X_STEPS_PER_MM))
+#define X_MAX_STEPS ((int32_t)(CONFIG_X_MAX*CONFIG_X_STEPS_PER_MM))
+#define Y_MIN_STEPS ((int32_t)(CONFIG_Y_MIN*CONFIG_Y_STEPS_PER_MM))
+#define Y_MAX_STEPS ((int32_t)(CONFIG_Y_MAX*CONFIG_Y_STEPS_PER_MM))
+#define Z_MIN_STEPS ((int32_t)(CONFIG_Z_MIN*CONFIG_Z_STEPS_PER_MM))
+#define Z_MAX_STEPS ((int32_t)(CONFIG_Z_MAX*CONFIG_Z_STEPS_PER_MM))
 
 static block_t block_buffer[BLOCK_BUFFER_SIZE];  // ring buffer for motion instructions
 static volatile uint8_t block_buffer_head;       // index of the next block to be pushed
 static volatile uint8_t block_buffer_tail;       // index of the block to process now
+static volatile uint32_t queued_duration_ms;     // sum of duration_ms of all blocks in the buffer
+static volatile uint8_t pending_assist_on_bits;  // commands waiting for the next line block
+static volatile uint8_t pending_assist_off_bits;
 
 static int32_t position[3];             // The current position of the tool in absolute steps
 static volatile bool position_update_requested;  // make sure to update to stepper position on next occasion
+static bool soft_limits_enabled;        // lines out of the machine bounds get rejected
 static double previous_unit_vec[3];     // Unit vector of previous path line segment
 static double previous_nominal_speed;   // Nominal speed of previous path line segment
+static double coalesce_deviation;       // Max deviation from the path of the lines merged into the newest block
+static double previous_millimeters;     // Length of previous path line segment
+
+#ifdef CONFIG_JUNCTION_CURVATURE
+  #define CURVATURE_WINDOW 4                         // number of junctions the curvature is estimated from
+  static double curvature_angles[CURVATURE_WINDOW];  // turning angles of the last smooth junctions (rad)
+  static double curvature_lengths[CURVATURE_WINDOW]; // path length around each of these junctions (mm)
+  static uint8_t curvature_index;                    // where the next junction goes in the window
+  static uint8_t curvature_count;                    // number of consecutive smooth junctions, up to window size
+  static double previous_turn_axis[3];               // axis about which the previous junction turned
+#endif
 
 // prototypes for static functions (non-accesible from other files)
 static int8_t next_block_index(int8_t block_index);
 static int8_t prev_block_index(int8_t block_index);
+static uint8_t blocks_queued();
 static double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration);
 static double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance);
 static double max_allowable_speed(double acceleration, double target_velocity, double distance);
 static void calculate_trapezoid_for_block(block_t *block, double entry_factor, double exit_factor);
-static void reduce_entry_speed_reverse(block_t *current, block_t *next);
+static void calculate_trapezoid_from(block_t *block, uint32_t step_events);
+static void calculate_line_for_block(block_t *block, int32_t *start, int32_t *target, 
+                                     double feed_rate, double *unit_vec);
+static bool coalesce_line(int32_t *target, double feed_rate, uint8_t nominal_laser_intensity);
+#ifdef CONFIG_JUNCTION_CURVATURE
+  static double curvature_junction_speed(double *unit_vec, double millimeters, double cos_theta, 
+                                         double vmax_junction, double v_nominal);
+#endif
+static bool set_entry_speed(block_t *previous, block_t *current, double entry_speed);
+static void reduce_entry_speed_reverse(block_t *previous, block_t *current, block_t *next);
 static void reduce_entry_speed_forward(block_t *previous, block_t *current);
 static void planner_recalculate();
+static void set_block_duration(block_t *block, uint32_t duration_ms);
+static void prepare_trapezoid(uint8_t block_index);
 
 
 
 void planner_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  queued_duration_ms = 0;
+  pending_assist_on_bits = 0;
+  pending_assist_off_bits = 0;
   clear_vector(position);
   planner_set_position( CONFIG_X_ORIGIN_OFFSET, 
                         CONFIG_Y_ORIGIN_OFFSET, 
                         CONFIG_Z_ORIGIN_OFFSET );  
   position_update_requested = false;
+  soft_limits_enabled = true;
   clear_vector_double(previous_unit_vec);
   previous_nominal_speed = 0.0;
+  coalesce_deviation = 0.0;
 }
 
 
 
 // Add a new linear movement to the buffer. x, y and z is 
 // the signed, absolute target position in millimeters. Feed rate specifies the speed of the motion.
-void planner_line(double x, double y, double z, double feed_rate, uint8_t nominal_laser_intensity) {    
+bool planner_line(double x, double y, double z, double feed_rate, uint8_t nominal_laser_intensity) {    
   // calculate target position in absolute steps
   int32_t target[3];
   target[X_AXIS] = lround(x*CONFIG_X_STEPS_PER_MM);
   target[Y_AXIS] = lround(y*CONFIG_Y_STEPS_PER_MM);
   target[Z_AXIS] = lround(z*CONFIG_Z_STEPS_PER_MM); 
 
+  #ifdef CONFIG_SOFT_LIMITS
+    // reject lines out of the machine bounds, the position stays where it was
+    if (soft_limits_enabled && 
+        (target[X_AXIS] < X_MIN_STEPS || target[X_AXIS] > X_MAX_STEPS ||
+         target[Y_AXIS] < Y_MIN_STEPS || target[Y_AXIS] > Y_MAX_STEPS ||
+         target[Z_AXIS] < Z_MIN_STEPS || target[Z_AXIS] > Z_MAX_STEPS)) {
+      return false;
+    }
+  #endif
+
+  // extend the newest block instead when this line just continues it
+  if (coalesce_line(target, feed_rate, nominal_laser_intensity)) {
+    stepper_prepare_segments();
+    return true;
+  }
+
   // calculate the buffer head and check for space
   int next_buffer_head = next_block_index( block_buffer_head );	
   while(block_buffer_tail == next_buffer_head) {  // buffer full condition
     // good! We are well ahead of the robot. Rest here until buffer has room.
+    stepper_prepare_segments();
     // sleep_mode();
   }
   
   // handle position update after a stop
   if (position_update_requested) {
-    planner_set_position(stepper_get_position_x(), stepper_get_position_y(), stepper_get_position_z());
+    int32_t steps[3];
+    stepper_get_position_steps(steps);
+    planner_set_position_steps(steps);
     position_update_requested = false;
     //printString("planner pos update\n");  // debug
   }
   
   // prepare to set up new block
   block_t *block = &block_buffer[block_buffer_head];
-  
-  // set block type to line command
-  block->type = TYPE_LINE;
 
   // set nominal laser intensity
   block->nominal_laser_intensity = nominal_laser_intensity;
 
-  // compute direction bits for this block
-  block->direction_bits = 0;
-  if (target[X_AXIS] < position[X_AXIS]) { block->direction_bits |= (1<<X_DIRECTION_BIT); }
-  if (target[Y_AXIS] < position[Y_AXIS]) { block->direction_bits |= (1<<Y_DIRECTION_BIT); }
-  if (target[Z_AXIS] < position[Z_AXIS]) { block->direction_bits |= (1<<Z_DIRECTION_BIT); }
-  
-  // number of steps for each axis
-  block->steps_x = labs(target[X_AXIS]-position[X_AXIS]);
-  block->steps_y = labs(target[Y_AXIS]-position[Y_AXIS]);
-  block->steps_z = labs(target[Z_AXIS]-position[Z_AXIS]);
-  block->step_event_count = max(block->steps_x, max(block->steps_y, block->steps_z));
-  if (block->step_event_count == 0) { return; };  // bail if this is a zero-length block
-  
-  // compute path vector in terms of absolute step target and current positions
-  double delta_mm[3];
-  delta_mm[X_AXIS] = (target[X_AXIS]-position[X_AXIS])/CONFIG_X_STEPS_PER_MM;
-  delta_mm[Y_AXIS] = (target[Y_AXIS]-position[Y_AXIS])/CONFIG_Y_STEPS_PER_MM;
-  delta_mm[Z_AXIS] = (target[Z_AXIS]-position[Z_AXIS])/CONFIG_Z_STEPS_PER_MM;
-  block->millimeters = sqrt( (delta_mm[X_AXIS]*delta_mm[X_AXIS]) + 
-                             (delta_mm[Y_AXIS]*delta_mm[Y_AXIS]) + 
-                             (delta_mm[Z_AXIS]*delta_mm[Z_AXIS]) );
-  double inverse_millimeters = 1.0/block->millimeters;  // store for efficency	
-  
-  // calculate nominal_speed (mm/min) and nominal_rate (step/min)
-  // minimum stepper speed is limited by MINIMUM_STEPS_PER_MINUTE in stepper.c
-  double inverse_minute = feed_rate * inverse_millimeters;
-  block->nominal_speed = block->millimeters * inverse_minute; // always > 0
-  block->nominal_rate = ceil(block->step_event_count * inverse_minute); // always > 0
-  
-  // compute the acceleration rate for this block. (step/min/acceleration_tick)
-  block->rate_delta = ceil( block->step_event_count * inverse_millimeters 
-                            * CONFIG_ACCELERATION / (60 * ACCELERATION_TICKS_PER_SECOND) );
+  // compute direction bits, step counts, nominal speeds and the path unit vector
+  double unit_vec[3];
+  calculate_line_for_block(block, position, target, feed_rate, unit_vec);
+  if (block->step_event_count == 0) { return true; };  // bail if this is a zero-length block
+
+  // When the host can not keep up the buffer drains and the planner would have to stop at the
+  // end of it. Stretch short lines while the buffer is low so each one lasts long enough for
+  // the next to arrive. The closer to empty, the more they get stretched. The intensity is
+  // scaled down with the speed to keep the energy per mm the same.
+  uint8_t queued = blocks_queued();
+  if ((queued > 1) && (queued < SLOWDOWN_THRESHOLD)) {
+    double segment_time = block->millimeters/block->nominal_speed * 60000000.0;  // us
+    if (segment_time < CONFIG_MIN_SEGMENT_TIME) {
+      double slowdown_factor = segment_time / 
+                               (segment_time + 2.0*(CONFIG_MIN_SEGMENT_TIME-segment_time)/queued);
+      block->nominal_speed *= slowdown_factor;
+      block->nominal_rate = ceil(block->nominal_rate * slowdown_factor);  // (Q24.8)
+      block->nominal_laser_intensity = lround(block->nominal_laser_intensity * slowdown_factor);
+    }
+  }
 
 
   //// acceleeration manager calculations
-  // Compute path unit vector                            
-  double unit_vec[3];
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;  
-
   // Compute max junction speed by centripetal acceleration approximation.
   // Let a circle be tangent to both previous and current path line segments, where the junction 
   // deviation is defined as the distance from the junction to the closest edge of the circle, 
@@ -165,13 +207,24 @@ void planner_line(double x, double y, double z, double feed_rate, uint8_t nomina
                                                   * sin_theta_d2/(1.0-sin_theta_d2) ) );
       }
     }
+    #ifdef CONFIG_JUNCTION_CURVATURE
+      vmax_junction = curvature_junction_speed( unit_vec, block->millimeters, cos_theta, vmax_junction,
+                                                min(previous_nominal_speed, block->nominal_speed) );
+    #endif
   }
+  #ifdef CONFIG_JUNCTION_CURVATURE
+    else {
+      curvature_count = 0;  // no previous segment, start a new curve
+    }
+  #endif
   block->vmax_junction = vmax_junction;
   
   // Initialize entry_speed. Compute based on deceleration to zero.
   // This will be updated in the forward and reverse planner passes.
+  // Stays at zero when the stepper is already executing the previous block, planned to stop.
   double v_allowable = max_allowable_speed(-CONFIG_ACCELERATION, ZERO_SPEED, block->millimeters);
-  block->entry_speed = min(vmax_junction, v_allowable);
+  block->busy_flag = false;
+  block->entry_speed = ZERO_SPEED;
 
   // Set nominal_length_flag for more efficiency.
   // If a block can de/ac-celerate from nominal speed to zero within the length of 
@@ -180,21 +233,41 @@ void planner_line(double x, double y, double z, double feed_rate, uint8_t nomina
   if (block->nominal_speed <= v_allowable) { block->nominal_length_flag = true; }
   else { block->nominal_length_flag = false; }
   block->recalculate_flag = true; // always calculate trapezoid for new block
+  if (block_buffer_head != block_buffer_tail) {
+    // the newest block before this one does not have to stop at its end anymore
+    set_entry_speed(&block_buffer[prev_block_index(block_buffer_head)], block, 
+                    min(vmax_junction, v_allowable));
+  }
+  // estimate the duration at nominal speed until the trapezoid is known
+  block->duration_ms = 0;  // not accounted for in queued_duration_ms yet
+  set_block_duration(block, lround(block->millimeters/block->nominal_speed*60000.0));
 
   // update previous unit_vector and nominal speed
   memcpy(previous_unit_vec, unit_vec, sizeof(unit_vec)); // previous_unit_vec[] = unit_vec[]
   previous_nominal_speed = block->nominal_speed;
+  previous_millimeters = block->millimeters;
+  coalesce_deviation = 0.0;  // a fresh block follows the path exactly
   //// end of acceleeration manager calculations
 
 
-  // move buffer head and update position
-  block_buffer_head = next_buffer_head;     
+  // attach the commands queued since the last line and move buffer head
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    block->assist_on_bits = pending_assist_on_bits;
+    block->assist_off_bits = pending_assist_off_bits;
+    pending_assist_on_bits = 0;
+    pending_assist_off_bits = 0;
+    block_buffer_head = next_buffer_head;
+  }
   memcpy(position, target, sizeof(target)); // position[] = target[]
 
   planner_recalculate();
 
+  // have segments ready before the stepper interrupt needs them
+  stepper_prepare_segments();
+
   // make sure the stepper interrupt is processing
   stepper_wake_up();
+  return true;
 }
 
 
@@ -213,46 +286,155 @@ void planner_dwell(double seconds, uint8_t nominal_laser_intensity) {
 
 
 void planner_command(uint8_t type) {
-  // calculate the buffer head and check for space
-  int next_buffer_head = next_block_index( block_buffer_head );	
-  while(block_buffer_tail == next_buffer_head) {  // buffer full condition
-    // good! We are well ahead of the robot. Rest here until buffer has room.
-    // sleep_mode();
-  }    
+  uint8_t assist_bit = 0;
+  bool enable = false;
+  switch (type) {
+    case TYPE_AIR_ASSIST_ENABLE: enable = true;  // fall through
+    case TYPE_AIR_ASSIST_DISABLE: assist_bit = ASSIST_AIR; break;
+    case TYPE_AUX1_ASSIST_ENABLE: enable = true;  // fall through
+    case TYPE_AUX1_ASSIST_DISABLE: assist_bit = ASSIST_AUX1; break;
+    case TYPE_AUX2_ASSIST_ENABLE: enable = true;  // fall through
+    case TYPE_AUX2_ASSIST_DISABLE: assist_bit = ASSIST_AUX2; break;
+  }
 
-  // Prepare to set up new block
-  block_t *block = &block_buffer[block_buffer_head];
+  // the latest command for an assist wins
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (enable) {
+      pending_assist_on_bits |= assist_bit;
+      pending_assist_off_bits &= ~assist_bit;
+    } else {
+      pending_assist_off_bits |= assist_bit;
+      pending_assist_on_bits &= ~assist_bit;
+    }
+  }
 
-  // set block type command
-  block->type = type;
+  // make sure the stepper interrupt is processing
+  // when no more lines follow it executes the command after the current motion
+  stepper_wake_up();
+}
 
-  // Move buffer head
-  block_buffer_head = next_buffer_head;
 
-  // make sure the stepper interrupt is processing  
-  stepper_wake_up();
+void planner_take_pending_commands(uint8_t *assist_on_bits, uint8_t *assist_off_bits) {
+  *assist_on_bits = pending_assist_on_bits;
+  *assist_off_bits = pending_assist_off_bits;
+  pending_assist_on_bits = 0;
+  pending_assist_off_bits = 0;
 }
 
 
 
+// Trapezoids depend on the entry speed of the following block and change whenever a line is
+// added. Instead of recalculating them for the whole buffer each time, they are calculated
+// only for the BLOCK_PREPARE_AHEAD blocks following those the stepper has claimed, i.e. 
+// shortly before it needs them. Clearing the flag publishes the trapezoid.
+void planner_prepare_blocks() {
+  uint8_t block_index = block_buffer_tail;
+  uint8_t blocks_ahead = 0;
+  while ((block_index != block_buffer_head) && (blocks_ahead < BLOCK_PREPARE_AHEAD)) {
+    if (!block_buffer[block_index].busy_flag) {  // busy ones are final, being cut into segments
+      prepare_trapezoid(block_index);
+      blocks_ahead++;
+    }
+    block_index = next_block_index( block_index );
+  }
+}
+
+
+
+void planner_soft_limits(bool enable) {
+  soft_limits_enabled = enable;
+}
+
+
 bool planner_blocks_available() {
   return block_buffer_head != block_buffer_tail;
 }
 
+uint8_t planner_blocks_free() {
+  return BLOCK_BUFFER_SIZE - 1 - blocks_queued();
+}
+
+uint32_t planner_queued_duration() {
+  uint32_t duration;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    duration = queued_duration_ms;
+  }
+  return duration;
+}
+
+// Calculates and publishes the trapezoid of a block flagged for it
+static void prepare_trapezoid(uint8_t block_index) {
+  block_t *block = &block_buffer[block_index];
+  if (!block->recalculate_flag) { return; }
+  // the newest block always plans to stop at its end
+  double exit_speed = ZERO_SPEED;
+  uint8_t next_index = next_block_index( block_index );
+  if (next_index != block_buffer_head) { exit_speed = block_buffer[next_index].entry_speed; }
+  calculate_trapezoid_for_block( block, 
+      block->entry_speed/block->nominal_speed, exit_speed/block->nominal_speed );
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    block->recalculate_flag = false;  // publish, only after all fields are written
+  }
+}
+
 block_t *planner_get_current_block() {
   if (block_buffer_head == block_buffer_tail) { return(NULL); }
   return(&block_buffer[block_buffer_tail]);
 }
 
+block_t *planner_claim_next_block() {
+  uint8_t block_index = block_buffer_tail;
+  while (block_index != block_buffer_head) {
+    block_t *block = &block_buffer[block_index];
+    if (!block->busy_flag) {
+      // a block replanned since its last trapezoid gets it now, claiming never waits for it
+      prepare_trapezoid(block_index);
+      block->busy_flag = true;
+      return(block);
+    }
+    block_index = next_block_index( block_index );
+  }
+  return(NULL);
+}
+
+void planner_resume_block(block_t *block, uint32_t step_events, uint32_t rate) {
+  // the planned exit may be out of reach from this rate
+  double initial_rate = (double)rate / RATE_SCALE;
+  double acceleration_per_minute = 
+    (double)block->rate_delta / RATE_SCALE * ACCELERATION_TICKS_PER_SECOND * 60; // (step/min^2)
+  double reachable_rate = sqrt( initial_rate*initial_rate + 
+                                2.0*acceleration_per_minute*(block->step_event_count - step_events) );
+  block->initial_rate = rate;
+  block->final_rate = min(block->final_rate, lround(reachable_rate*RATE_SCALE));
+  calculate_trapezoid_from(block, step_events);
+
+  // the next block can not enter faster than this one exits
+  uint8_t next_index = next_block_index( block - block_buffer );
+  if (next_index != block_buffer_head) {
+    block_t *next = &block_buffer[next_index];
+    double exit_speed = block->nominal_speed * block->final_rate / block->nominal_rate;
+    if ((next->entry_speed > exit_speed) && !next->busy_flag) {
+      next->entry_speed = exit_speed;
+      next->recalculate_flag = true;
+      planner_recalculate();
+    }
+  }
+}
+
 void planner_discard_current_block() {
   if (block_buffer_head != block_buffer_tail) {
+    queued_duration_ms -= block_buffer[block_buffer_tail].duration_ms;
     block_buffer_tail = next_block_index( block_buffer_tail );
+    if (block_buffer_head == block_buffer_tail) { queued_duration_ms = 0; }  // no round-off drift
   }
 }
 
 void planner_reset_block_buffer() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  queued_duration_ms = 0;
+  pending_assist_on_bits = 0;
+  pending_assist_off_bits = 0;
 }
 
 
@@ -260,11 +442,21 @@ void planner_reset_block_buffer() {
 
 // Reset the planner position vector and planner speed
 void planner_set_position(double x, double y, double z) {
-  position[X_AXIS] = lround(x*CONFIG_X_STEPS_PER_MM);
-  position[Y_AXIS] = lround(y*CONFIG_Y_STEPS_PER_MM);
-  position[Z_AXIS] = lround(z*CONFIG_Z_STEPS_PER_MM);    
+  int32_t steps[3];
+  steps[X_AXIS] = lround(x*CONFIG_X_STEPS_PER_MM);
+  steps[Y_AXIS] = lround(y*CONFIG_Y_STEPS_PER_MM);
+  steps[Z_AXIS] = lround(z*CONFIG_Z_STEPS_PER_MM);    
+  planner_set_position_steps(steps);
+}
+
+// Same in absolute steps, takes the stepper position without a round trip through mm
+void planner_set_position_steps(const int32_t *steps) {
+  memcpy(position, steps, sizeof(position)); // position[] = steps[]
   previous_nominal_speed = 0.0; // resets planner junction speeds
   clear_vector_double(previous_unit_vec);
+  #ifdef CONFIG_JUNCTION_CURVATURE
+    curvature_count = 0;
+  #endif
 }
 
 void planner_request_position_update() {
@@ -287,6 +479,217 @@ static int8_t prev_block_index(int8_t block_index) {
   return block_index;
 }
 
+// Returns the number of blocks in the ring buffer
+static uint8_t blocks_queued() {
+  uint8_t tail = block_buffer_tail;  // optimize for volatile
+  if (block_buffer_head >= tail) { return block_buffer_head - tail; }
+  return BLOCK_BUFFER_SIZE - tail + block_buffer_head;
+}
+
+
+// Computes direction bits, step counts, length, nominal speed and rate, and the acceleration
+// rate of a line block going from start to target (both in absolute steps). Also yields the
+// unit vector of the path. Zero-length lines leave step_event_count at 0 and skip the rest.
+static void calculate_line_for_block(block_t *block, int32_t *start, int32_t *target, 
+                                     double feed_rate, double *unit_vec) {
+  // compute direction bits for this block
+  block->direction_bits = 0;
+  if (target[X_AXIS] < start[X_AXIS]) { block->direction_bits |= (1<<X_DIRECTION_BIT); }
+  if (target[Y_AXIS] < start[Y_AXIS]) { block->direction_bits |= (1<<Y_DIRECTION_BIT); }
+  if (target[Z_AXIS] < start[Z_AXIS]) { block->direction_bits |= (1<<Z_DIRECTION_BIT); }
+  
+  // number of steps for each axis
+  block->steps_x = labs(target[X_AXIS]-start[X_AXIS]);
+  block->steps_y = labs(target[Y_AXIS]-start[Y_AXIS]);
+  block->steps_z = labs(target[Z_AXIS]-start[Z_AXIS]);
+  block->step_event_count = max(block->steps_x, max(block->steps_y, block->steps_z));
+  if (block->step_event_count == 0) { return; };  // zero-length block
+  
+  // compute path vector in terms of absolute step target and start positions
+  double delta_mm[3];
+  delta_mm[X_AXIS] = (target[X_AXIS]-start[X_AXIS])/CONFIG_X_STEPS_PER_MM;
+  delta_mm[Y_AXIS] = (target[Y_AXIS]-start[Y_AXIS])/CONFIG_Y_STEPS_PER_MM;
+  delta_mm[Z_AXIS] = (target[Z_AXIS]-start[Z_AXIS])/CONFIG_Z_STEPS_PER_MM;
+  block->millimeters = sqrt( (delta_mm[X_AXIS]*delta_mm[X_AXIS]) + 
+                             (delta_mm[Y_AXIS]*delta_mm[Y_AXIS]) + 
+                             (delta_mm[Z_AXIS]*delta_mm[Z_AXIS]) );
+  double inverse_millimeters = 1.0/block->millimeters;  // store for efficency	
+  
+  // calculate nominal_speed (mm/min) and nominal_rate (step/min, Q24.8)
+  // minimum stepper speed is limited by MINIMUM_STEPS_PER_MINUTE in stepper.c (0.5mm/min)
+  double inverse_minute = feed_rate * inverse_millimeters;
+  block->nominal_speed = feed_rate; // always > 0
+  block->nominal_rate = ceil(block->step_event_count * inverse_minute * RATE_SCALE); // always > 0
+  
+  // compute the acceleration rate for this block. (step/min/acceleration_tick, Q24.8)
+  // rounded, not ceiled, the fraction keeps the acceleration within 1/256 step/min per tick
+  block->rate_delta = lround( block->step_event_count * inverse_millimeters 
+                              * CONFIG_ACCELERATION * RATE_SCALE / (60 * ACCELERATION_TICKS_PER_SECOND) );
+  block->rate_delta = max(block->rate_delta, 1);
+
+  // Compute path unit vector
+  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
+  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
+  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;  
+}
+
+
+//                   time->
+//     [tail][][][][newest] [head]
+//                 \_______/ <- line to target
+//
+// Merge the line to target into the newest block when it continues that block at the same
+// feed and intensity and the joined, straight block stays within CONFIG_COALESCE_TOLERANCE
+// of all the lines it replaces. The block is temporarily taken out of the buffer while it is
+// rewritten so the stepper interrupt can never discard it half-done. Blocks the stepper has
+// already claimed are never merged into. Returns true when the line was merged.
+static bool coalesce_line(int32_t *target, double feed_rate, uint8_t nominal_laser_intensity) {
+  if (CONFIG_COALESCE_TOLERANCE <= 0.0) { return false; }
+  if (previous_nominal_speed == 0.0) { return false; }  // nothing to continue after a reset
+  
+  uint8_t newest_index = prev_block_index( block_buffer_head );
+  block_t *block = &block_buffer[newest_index];
+  if ( (block->nominal_speed != feed_rate) || 
+       (block->nominal_laser_intensity != nominal_laser_intensity) ) { return false; }
+  // commands queued in between have to execute at the junction
+  if (pending_assist_on_bits || pending_assist_off_bits) { return false; }
+
+  // start of the newest block
+  int32_t start[3];
+  start[X_AXIS] = position[X_AXIS] + ((block->direction_bits & (1<<X_DIRECTION_BIT)) ? 
+                                      (int32_t)block->steps_x : -(int32_t)block->steps_x);
+  start[Y_AXIS] = position[Y_AXIS] + ((block->direction_bits & (1<<Y_DIRECTION_BIT)) ? 
+                                      (int32_t)block->steps_y : -(int32_t)block->steps_y);
+  start[Z_AXIS] = position[Z_AXIS] + ((block->direction_bits & (1<<Z_DIRECTION_BIT)) ? 
+                                      (int32_t)block->steps_z : -(int32_t)block->steps_z);
+
+  // current position (joint) and target relative to the start of the newest block
+  double joint_mm[3], target_mm[3];
+  joint_mm[X_AXIS] = (position[X_AXIS]-start[X_AXIS])/CONFIG_X_STEPS_PER_MM;
+  joint_mm[Y_AXIS] = (position[Y_AXIS]-start[Y_AXIS])/CONFIG_Y_STEPS_PER_MM;
+  joint_mm[Z_AXIS] = (position[Z_AXIS]-start[Z_AXIS])/CONFIG_Z_STEPS_PER_MM;
+  target_mm[X_AXIS] = (target[X_AXIS]-start[X_AXIS])/CONFIG_X_STEPS_PER_MM;
+  target_mm[Y_AXIS] = (target[Y_AXIS]-start[Y_AXIS])/CONFIG_Y_STEPS_PER_MM;
+  target_mm[Z_AXIS] = (target[Z_AXIS]-start[Z_AXIS])/CONFIG_Z_STEPS_PER_MM;
+
+  // the line has to move on in the direction of the newest block
+  double forward = (target_mm[X_AXIS]-joint_mm[X_AXIS])*previous_unit_vec[X_AXIS] + 
+                   (target_mm[Y_AXIS]-joint_mm[Y_AXIS])*previous_unit_vec[Y_AXIS] + 
+                   (target_mm[Z_AXIS]-joint_mm[Z_AXIS])*previous_unit_vec[Z_AXIS];
+  if (forward <= 0.0) { return false; }
+
+  // Distance of the joint from the joined block is |joint x target|/|target|. All earlier 
+  // joints are at most coalesce_deviation off the old block and the old block itself is at
+  // most this distance off the new one, so the sum bounds the error of the joined block.
+  double cross[3];
+  cross[X_AXIS] = joint_mm[Y_AXIS]*target_mm[Z_AXIS] - joint_mm[Z_AXIS]*target_mm[Y_AXIS];
+  cross[Y_AXIS] = joint_mm[Z_AXIS]*target_mm[X_AXIS] - joint_mm[X_AXIS]*target_mm[Z_AXIS];
+  cross[Z_AXIS] = joint_mm[X_AXIS]*target_mm[Y_AXIS] - joint_mm[Y_AXIS]*target_mm[X_AXIS];
+  double target_length = sqrt( (target_mm[X_AXIS]*target_mm[X_AXIS]) + 
+                               (target_mm[Y_AXIS]*target_mm[Y_AXIS]) + 
+                               (target_mm[Z_AXIS]*target_mm[Z_AXIS]) );
+  double deviation = coalesce_deviation + sqrt( (cross[X_AXIS]*cross[X_AXIS]) + 
+                                                (cross[Y_AXIS]*cross[Y_AXIS]) + 
+                                                (cross[Z_AXIS]*cross[Z_AXIS]) )/target_length;
+  if (deviation > CONFIG_COALESCE_TOLERANCE) { return false; }
+
+  // take the newest block out of the buffer, unless the stepper may already have it
+  bool detached = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if ( (block_buffer_head != block_buffer_tail) && 
+         (prev_block_index(block_buffer_head) == newest_index) &&
+         !block->busy_flag ) {
+      block_buffer_head = newest_index;
+      queued_duration_ms -= block->duration_ms;
+      block->duration_ms = 0;
+      detached = true;
+    }
+  }
+  if (!detached) { return false; }
+
+  // rewrite the block to go straight from its start to the new target
+  double unit_vec[3];
+  calculate_line_for_block(block, start, target, feed_rate, unit_vec);
+  double v_allowable = max_allowable_speed(-CONFIG_ACCELERATION, ZERO_SPEED, block->millimeters);
+  double entry_speed = min(block->vmax_junction, v_allowable);
+  if (block->entry_speed != entry_speed) {
+    set_entry_speed(&block_buffer[prev_block_index(newest_index)], block, entry_speed);
+  }
+  if (block->nominal_speed <= v_allowable) { block->nominal_length_flag = true; }
+  else { block->nominal_length_flag = false; }
+  block->recalculate_flag = true;
+  set_block_duration(block, lround(block->millimeters/block->nominal_speed*60000.0));
+  memcpy(previous_unit_vec, unit_vec, sizeof(unit_vec)); // previous_unit_vec[] = unit_vec[]
+  previous_millimeters = block->millimeters;
+  coalesce_deviation = deviation;
+
+  // put the block back, unless a stop purged the buffer in the meantime
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (!position_update_requested) {
+      block_buffer_head = next_block_index( newest_index );
+    }
+  }
+  memcpy(position, target, sizeof(position)); // position[] = target[]
+
+  planner_recalculate();
+
+  // make sure the stepper interrupt is processing
+  stepper_wake_up();
+  return true;
+}
+
+
+#ifdef CONFIG_JUNCTION_CURVATURE
+//          _.-'''-._
+//       .-'         '-.   <- many short segments, each turning by a small angle
+//      /               '.
+//
+// Junction speed for polylines that approximate smooth curves. The junction deviation model
+// above only sees one angle at a time and treats every vertex of a tessellated arc like a
+// corner. Here the curvature is estimated from the last CURVATURE_WINDOW junctions instead:
+// radius = path length / total turning angle. Once the window holds consecutive junctions
+// that all turn by less than CONFIG_CURVATURE_MAX_ANGLE, in the same sense, with segments of
+// similar length, the junction speed is set by centripetal acceleration on that radius,
+// v = sqrt(acceleration * radius). Anything else (real corners, straight runs, the first few
+// vertices of a curve) keeps the junction deviation speed.
+static double curvature_junction_speed(double *unit_vec, double millimeters, double cos_theta, 
+                                       double vmax_junction, double v_nominal) {
+  // turning angle phi = pi - theta, by small angle approximation phi ~ 2*sin(phi/2)
+  double turn_angle = 2.0*sqrt(0.5*(1.0+cos_theta));
+  double turn_axis[3];
+  turn_axis[X_AXIS] = previous_unit_vec[Y_AXIS]*unit_vec[Z_AXIS] - previous_unit_vec[Z_AXIS]*unit_vec[Y_AXIS];
+  turn_axis[Y_AXIS] = previous_unit_vec[Z_AXIS]*unit_vec[X_AXIS] - previous_unit_vec[X_AXIS]*unit_vec[Z_AXIS];
+  turn_axis[Z_AXIS] = previous_unit_vec[X_AXIS]*unit_vec[Y_AXIS] - previous_unit_vec[Y_AXIS]*unit_vec[X_AXIS];
+  double same_sense = turn_axis[X_AXIS]*previous_turn_axis[X_AXIS] + 
+                      turn_axis[Y_AXIS]*previous_turn_axis[Y_AXIS] + 
+                      turn_axis[Z_AXIS]*previous_turn_axis[Z_AXIS];
+  memcpy(previous_turn_axis, turn_axis, sizeof(turn_axis)); // previous_turn_axis[] = turn_axis[]
+
+  // a junction that does not continue the curve starts a new one
+  if ( (turn_angle > CONFIG_CURVATURE_MAX_ANGLE) || (same_sense <= 0.0) ||
+       (millimeters > 2.0*previous_millimeters) || (previous_millimeters > 2.0*millimeters) ) {
+    curvature_count = 0;
+  }
+  if (turn_angle > CONFIG_CURVATURE_MAX_ANGLE) { return vmax_junction; }  // a real corner
+
+  curvature_angles[curvature_index] = turn_angle;
+  curvature_lengths[curvature_index] = 0.5*(previous_millimeters + millimeters);
+  if (++curvature_index == CURVATURE_WINDOW) { curvature_index = 0; }
+  if (curvature_count < CURVATURE_WINDOW) { curvature_count++; }
+  if (curvature_count < CURVATURE_WINDOW) { return vmax_junction; }  // not sure yet
+
+  double angle_sum = 0.0;
+  double length_sum = 0.0;
+  uint8_t i;
+  for (i=0; i<CURVATURE_WINDOW; i++) {
+    angle_sum += curvature_angles[i];
+    length_sum += curvature_lengths[i];
+  }
+  if (angle_sum <= 0.0) { return vmax_junction; }
+  return min( v_nominal, sqrt(CONFIG_ACCELERATION * length_sum/angle_sum) );
+}
+#endif
+
 
 /*            target rate -> +
 **                          /|
@@ -352,34 +755,91 @@ static double max_allowable_speed(double acceleration, double target_velocity, d
 **                                   |        |
 **                      accelerate_until    decelerate_after                           
 */                                                                              
-// Calculates accelerate_until and decelerate_after.
+// Calculates accelerate_until and decelerate_after. Also updates the planned duration of the 
+// block and with it the total duration of the buffer.
 static void calculate_trapezoid_for_block(block_t *block, double entry_factor, double exit_factor) {
-  block->initial_rate = ceil(block->nominal_rate * entry_factor);  // (step/min)
-  block->final_rate = ceil(block->nominal_rate * exit_factor);     // (step/min)
-  int32_t acceleration_per_minute = block->rate_delta * ACCELERATION_TICKS_PER_SECOND * 60; // (step/min^2)
+  block->initial_rate = lround(block->nominal_rate * entry_factor);  // (step/min, Q24.8)
+  block->final_rate = lround(block->nominal_rate * exit_factor);     // (step/min, Q24.8)
+  calculate_trapezoid_from(block, 0);
+}
+
+
+// Calculates the trapezoid of the rest of a block, from step_events on. It starts at 
+// initial_rate and ends at final_rate.
+static void calculate_trapezoid_from(block_t *block, uint32_t step_events) {
+  int32_t step_event_count = block->step_event_count - step_events;
+  double nominal_rate = (double)block->nominal_rate / RATE_SCALE;  // (step/min)
+  double initial_rate = (double)block->initial_rate / RATE_SCALE;
+  double final_rate = (double)block->final_rate / RATE_SCALE;
+  double acceleration_per_minute = 
+    (double)block->rate_delta / RATE_SCALE * ACCELERATION_TICKS_PER_SECOND * 60; // (step/min^2)
   int32_t accelerate_steps = 
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration_per_minute));
+    ceil(estimate_acceleration_distance(initial_rate, nominal_rate, acceleration_per_minute));
   int32_t decelerate_steps = 
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
+    floor(estimate_acceleration_distance(nominal_rate, final_rate, -acceleration_per_minute));
     
   // Calculate the size of Plateau of Nominal Rate. 
-  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+  int32_t plateau_steps = step_event_count-accelerate_steps-decelerate_steps;
   
   // Handle special case where we don't reach a plateau.
   if (plateau_steps < 0) {  
-    accelerate_steps = ceil( intersection_distance( block->initial_rate, block->final_rate, 
-                             acceleration_per_minute, block->step_event_count ) );
+    accelerate_steps = ceil( intersection_distance( initial_rate, final_rate, 
+                             acceleration_per_minute, step_event_count ) );
     accelerate_steps = max(accelerate_steps, 0);  // check limits due to numerical round-off
-    accelerate_steps = min(accelerate_steps, block->step_event_count);
+    accelerate_steps = min(accelerate_steps, step_event_count);
     plateau_steps = 0;
   }  
   
-  block->accelerate_until = accelerate_steps;
-  block->decelerate_after = accelerate_steps+plateau_steps;
+  block->accelerate_until = step_events+accelerate_steps;
+  block->decelerate_after = step_events+accelerate_steps+plateau_steps;
+
+  // duration: time to reach the peak rate, plus the plateau, plus time to slow down to final rate
+  double peak_rate = nominal_rate;
+  if (plateau_steps == 0) {
+    peak_rate = sqrt( initial_rate*initial_rate + 2.0*acceleration_per_minute*accelerate_steps );
+  }
+  #ifdef CONFIG_S_CURVE
+    block->peak_rate = min(lround(peak_rate*RATE_SCALE), block->nominal_rate);
+  #endif
+  double minutes = ( (peak_rate-initial_rate) + (peak_rate-final_rate) ) 
+                   / acceleration_per_minute + plateau_steps/peak_rate;
+  set_block_duration(block, lround(minutes*60000.0));
+}
+
+
+// Sets the planned duration of a block and keeps the total of the buffer in sync.
+static void set_block_duration(block_t *block, uint32_t duration_ms) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    queued_duration_ms += duration_ms - block->duration_ms;
+    block->duration_ms = duration_ms;
+  }
 }
 
 
-static void reduce_entry_speed_reverse(block_t *current, block_t *next) {
+//                   time->
+//     [tail][][][previous][current][][][][head]
+//                        ^
+//                     junction
+//
+// Sets the entry speed of current. This also changes the exit of previous, so both trapezoids
+// are flagged for recalculation. Claiming a flagged block calculates its trapezoid first and
+// the planner does not touch claimed (busy) blocks. Once previous is claimed its exit is final and the 
+// entry speed of current can not be changed anymore. Returns false in that case.
+static bool set_entry_speed(block_t *previous, block_t *current, double entry_speed) {
+  bool entry_speed_set = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (!previous->busy_flag) {
+      previous->recalculate_flag = true;
+      current->entry_speed = entry_speed;
+      current->recalculate_flag = true;
+      entry_speed_set = true;
+    }
+  }
+  return entry_speed_set;
+}
+
+
+static void reduce_entry_speed_reverse(block_t *previous, block_t *current, block_t *next) {
   // 'next' here is the newer/later block, not the next in the iteration
   //                   time->
   //     [tail][][][current][next][][][][head] -> loops around to tail
@@ -388,13 +848,15 @@ static void reduce_entry_speed_reverse(block_t *current, block_t *next) {
   // Reduce entry_speed if necessary so next entry_speed can definitely be reached with
   // fixed acceleration. This is specifically relevant for short blocks that never plateau.
   // Skip if we already flagged the block as plateauing or vmax <= next entry_speed. 
+  double entry_speed = current->vmax_junction;
   if ((!current->nominal_length_flag) && (current->vmax_junction > next->entry_speed)) {
-    current->entry_speed = min( current->vmax_junction, max_allowable_speed(
+    entry_speed = min( current->vmax_junction, max_allowable_speed(
                   -CONFIG_ACCELERATION, next->entry_speed, current->millimeters) );
-  } else {
-    current->entry_speed = current->vmax_junction;
-  } 
-  current->recalculate_flag = true;
+  }
+  // Check for junction speed change
+  if (current->entry_speed != entry_speed) {
+    set_entry_speed(previous, current, entry_speed);
+  }
   // no worries about last block, forward pass takes care of it
 }
 
@@ -414,8 +876,7 @@ static void reduce_entry_speed_forward(block_t *previous, block_t *current) {
         max_allowable_speed(-CONFIG_ACCELERATION, previous->entry_speed, previous->millimeters) );
       // Check for junction speed change
       if (current->entry_speed != entry_speed) {
-        current->entry_speed = entry_speed;
-        current->recalculate_flag = true;
+        set_entry_speed(previous, current, entry_speed);
       }
     }    
   }
@@ -425,6 +886,7 @@ static void reduce_entry_speed_forward(block_t *previous, block_t *current) {
 // planner, called whenever a new block was added
 // All planner computations are performed with doubles (float on Arduinos) to minimize numerical round-
 // off errors. Only when planned values are converted to stepper rate parameters, these are integers.
+// The stepper keeps running meanwhile. Blocks it has claimed are left alone, see set_entry_speed().
 static void planner_recalculate() {
   //// reverse pass
   // Recalculate entry_speed to be (a) less or equal to vmax_junction and
@@ -439,7 +901,7 @@ static void planner_recalculate() {
     current = previous;
     previous = &block_buffer[block_index];
     if (current && next) {
-      reduce_entry_speed_reverse(current, next);
+      reduce_entry_speed_reverse(previous, current, next);
     }
   } // skip tail/first block
   
@@ -463,30 +925,12 @@ static void planner_recalculate() {
     reduce_entry_speed_forward(current, next);
   }
   
-  //// recalculate trapeziods for all flagged blocks
+  //// trapezoids
   // At this point all blocks have entry_speeds that that can be (a) reached from the prevous
   // entry_speed with the one and only acceleration from our settings and (b) have junction
-  // speeds that do not exceed our limits for given direction change.
-  // Now we only need to calculate the actual accelerate_until and decelerate_after values.
-  block_index = block_buffer_tail;
-  current = NULL;
-  next = NULL;
-  while(block_index != block_buffer_head) {
-    current = next;
-    next = &block_buffer[block_index];
-    if (current) {
-      if (current->recalculate_flag || next->recalculate_flag) {
-        calculate_trapezoid_for_block( current, 
-            current->entry_speed/current->nominal_speed, 
-            next->entry_speed/current->nominal_speed );      
-        current->recalculate_flag = false;
-      }
-    }
-    block_index = next_block_index( block_index );
-  }
-  // always recalculate last (newest) block with zero exit speed
-  calculate_trapezoid_for_block( next, 
-    next->entry_speed/next->nominal_speed, ZERO_SPEED/next->nominal_speed );
-  next->recalculate_flag = false;
+  // speeds that do not exceed our limits for given direction change. Blocks with a changed
+  // entry or exit speed are flagged. Their trapezoids are only calculated once they come
+  // close to being executed.
+  planner_prepare_blocks();
 }
 
@@ -24,8 +24,9 @@
 #include "config.h"
 
 
-// Command types the planner and stepper can schedule for execution 
-#define TYPE_LINE 0
+// Non-motion commands. These do not take up a block of their own but get attached to the
+// next line block. The stepper executes them right before the first step of that block, or
+// as soon as the previous motion is done when no other line follows.
 #define TYPE_AIR_ASSIST_ENABLE 1
 #define TYPE_AIR_ASSIST_DISABLE 2
 #define TYPE_AUX1_ASSIST_ENABLE 3
@@ -33,6 +34,14 @@
 #define TYPE_AUX2_ASSIST_ENABLE 5
 #define TYPE_AUX2_ASSIST_DISABLE 6
 
+// Assist bits as used by the commands attached to blocks
+#define ASSIST_AIR  (1<<0)
+#define ASSIST_AUX1 (1<<1)
+#define ASSIST_AUX2 (1<<2)
+
+// Step rates are fixed point steps/minute with 8 fractional bits (Q24.8)
+#define RATE_SCALE 256L
+
 #define planner_control_air_assist_enable() planner_command(TYPE_AIR_ASSIST_ENABLE)
 #define planner_control_air_assist_disable() planner_command(TYPE_AIR_ASSIST_DISABLE)
 #define planner_control_aux1_assist_enable() planner_command(TYPE_AUX1_ASSIST_ENABLE)
@@ -45,12 +54,14 @@
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
 typedef struct {
-  uint8_t type;                       // Type of command, eg: TYPE_LINE, TYPE_AIR_ASSIST_ENABLE
+  // Commands to execute before the first step of this block
+  uint8_t assist_on_bits;             // Assists to switch on, eg: ASSIST_AIR
+  uint8_t assist_off_bits;            // Assists to switch off
   // Fields used by the bresenham algorithm for tracing the line
   uint32_t steps_x, steps_y, steps_z; // Step count along each axis
   uint8_t  direction_bits;            // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
   int32_t  step_event_count;          // The number of step events required to complete this block
-  uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute
+  uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute (Q24.8)
   // Fields used by the motion planner to manage acceleration
   double nominal_speed;               // The nominal speed for this block in mm/min  
   double entry_speed;                 // Entry speed at previous-current junction in mm/min
@@ -58,13 +69,18 @@ typedef struct {
   double millimeters;                 // The total travel of this block in mm
   uint8_t nominal_laser_intensity;    // 0-255 is 0-100% percentage
   bool recalculate_flag;              // Planner flag to recalculate trapezoids on entry junction
+  bool busy_flag;                     // Stepper flag for a block it cuts into segments, no more replanning
   bool nominal_length_flag;           // Planner flag for nominal speed always reached
   // Settings for the trapezoid generator
-  uint32_t initial_rate;              // The jerk-adjusted step rate at start of block  
-  uint32_t final_rate;                // The minimal rate at exit
-  int32_t rate_delta;                 // The steps/minute to add or subtract when changing speed (must be positive)
+  uint32_t initial_rate;              // The jerk-adjusted step rate at start of block (Q24.8)
+  uint32_t final_rate;                // The minimal rate at exit (Q24.8)
+  int32_t rate_delta;                 // The steps/minute to add or subtract when changing speed (Q24.8, must be positive)
   uint32_t accelerate_until;          // The index of the step event on which to stop acceleration
   uint32_t decelerate_after;          // The index of the step event on which to start decelerating
+  #ifdef CONFIG_S_CURVE
+  uint32_t peak_rate;                 // The rate at accelerate_until, below nominal_rate for short blocks
+  #endif
+  uint32_t duration_ms;               // Planned execution time of this block, from the trapezoid
 
 } block_t;
       
@@ -74,22 +90,48 @@ void planner_init();
 // Add a new linear movement to the buffer.
 // x, y and z is the signed, absolute target position in millimaters.
 // Feed rate specifies the speed of the motion.
-void planner_line(double x, double y, double z, double feed_rate, uint8_t nominal_laser_intensity);
+// Returns false when the line was rejected, its target is out of the soft limits.
+bool planner_line(double x, double y, double z, double feed_rate, uint8_t nominal_laser_intensity);
+
+// Turn the soft limits off (homing moves) and on again, on by default.
+void planner_soft_limits(bool enable);
 
 // Add a new piercing action, lasing at one spot.
 void planner_dwell(double seconds, uint8_t nominal_laser_intensity);
 
 // Add a non-motion command to the queue.
 // Typical types are: TYPE_AIR_ASSIST_ENABLE, TYPE_AIR_ASSIST_DISABLE, ...
-// This call is blocking when the block buffer is full.
+// The command is attached to the next line and does not interrupt the motion plan.
 void planner_command(uint8_t type);
 
+// Take the commands that are not attached to any line block. Called by the stepper when
+// it runs out of blocks, so commands after the last line still execute.
+void planner_take_pending_commands(uint8_t *assist_on_bits, uint8_t *assist_off_bits);
+
+
+// Calculate the trapezoids of the blocks about to be executed.
+// Called by the stepper's segment preparation.
+void planner_prepare_blocks();
 
 bool planner_blocks_available();
 
+// Number of blocks that can still be added to the buffer
+uint8_t planner_blocks_free();
+
+// Planned execution time of all blocks in the buffer in milliseconds
+uint32_t planner_queued_duration();
+
 // Gets the current block. Returns NULL if buffer empty
 block_t *planner_get_current_block();
 
+// Gets the oldest block not yet claimed by the stepper and claims it, the planner
+// does not change it anymore. Its trapezoid is brought up to date first. Returns NULL if there is none.
+block_t *planner_claim_next_block();
+
+// Replans the rest of a claimed block after a feed hold, from step_events on, starting at 
+// rate (step/min, Q24.8). Lowers the entry of the following blocks where it can not be reached.
+void planner_resume_block(block_t *block, uint32_t step_events, uint32_t rate);
+
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.
 void planner_discard_current_block();
@@ -100,6 +142,7 @@ void planner_reset_block_buffer();
 
 // Reset the position vector
 void planner_set_position(double x, double y, double z);
+void planner_set_position_steps(const int32_t *steps);
 
 // update to stepper position when steppers have been stopped
 // called from the stepper code that executes the stop
@@ -19,10 +19,31 @@
 #include <util/delay.h>
 #include <math.h>
 #include <stdlib.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "sense_control.h"
 #include "stepper.h"
 #include "planner.h"
 
+#if (DOOR_BIT != 2)
+  #error "the door has to be on PD2, INT0 cuts the laser when it opens"
+#endif
+
+// timer 2 runs at clk/128 while debouncing, 8us per tick at 16MHz
+#define DEBOUNCE_TICKS ((F_CPU/1000000)*CONFIG_SENSE_DEBOUNCE_MICROSECONDS/128)
+#if (DEBOUNCE_TICKS < 1) || (DEBOUNCE_TICKS > 256)
+  #error "CONFIG_SENSE_DEBOUNCE_MICROSECONDS out of the range of timer 2"
+#endif
+
+volatile uint8_t sense_state;                // sensor bits, see sense_control.h
+static volatile bool sense_state_changed;    // not reported yet
+static volatile bool laser_interlock;  // keeps the laser off, set when the door opens
+
+// prototypes for static functions (non-accesible from other files)
+static uint8_t sense_sample();
+static void sense_debounce_start();
+static void sense_pin_change();
+
 
 
 void sense_init() {
@@ -33,6 +54,93 @@ void sense_init() {
   //// x1_lmit, x2_limit, y1_limit, y2_limit, z1_limit, z2_limit
   LIMIT_DDR &= ~(LIMIT_MASK);  // set as input pins
   // LIMIT_PORT |= LIMIT_MASK;    //activate pull-up resistors   
+
+  //// sensor state, stop sensors trigger on the first edge, pin changes restart timer 2 
+  //// as a one-shot, its compare samples the pins once stable
+  sense_state = sense_sample();
+  sense_state_changed = false;
+  TCCR2A = (1<<WGM21);  // CTC
+  TCCR2B = 0;           // stopped until a pin changes
+  OCR2A = DEBOUNCE_TICKS - 1;
+  TIMSK2 = (1<<OCIE2A);
+  PCMSK1 = LIMIT_MASK;  // PCINT8.. are port C
+  PCMSK2 = SENSE_MASK;  // PCINT16.. are port D
+  PCICR |= (1<<PCIE1)|(1<<PCIE2);
+
+  //// door, opening it cuts the laser right away and holds the motion
+  laser_interlock = false;
+  #ifndef DEBUG_IGNORE_SENSORS
+    EICRA = (EICRA & ~(3<<ISC00)) | (1<<ISC01);  // falling edge of INT0 (PD2), door opens
+    EIFR = (1<<INTF0);                           // no stale edge from before
+    EIMSK |= (1<<INT0);
+    if (SENSE_DOOR_OPEN) {
+      control_laser_interlock(true);
+      stepper_request_hold();
+    }
+  #endif
+}
+
+
+bool sense_changed() {
+  bool changed;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    changed = sense_state_changed;
+    sense_state_changed = false;
+  }
+  return changed;
+}
+
+
+// Reads all sensor pins into the layout of sense_state, they are active low
+static uint8_t sense_sample() {
+  uint8_t state = ~LIMIT_PIN & LIMIT_MASK;
+  uint8_t sense_pins = ~SENSE_PIN;
+  if (sense_pins & (1<<CHILLER_BIT)) { state |= (1<<SENSE_CHILLER_OFF_BIT); }
+  if (sense_pins & (1<<DOOR_BIT)) { state |= (1<<SENSE_DOOR_OPEN_BIT); }
+  #ifndef DRIVEBOARD
+    if (sense_pins & (1<<POWER_BIT)) { state |= (1<<SENSE_POWER_OFF_BIT); }
+  #endif
+  return state;
+}
+
+// (Re)starts the debounce, the pins get sampled once they did not change for its time
+static void sense_debounce_start() {
+  TCNT2 = 0;
+  TIFR2 = (1<<OCF2A);
+  TCCR2B = (1<<CS22)|(1<<CS20);  // clk/128
+}
+
+// A sensor pin changed. Stop sensors (limits, power) count on their first active edge, a 
+// chattering switch can not hold them back. Only their release and the other sensors wait 
+// for the pins to be stable.
+static void sense_pin_change() {
+  uint8_t triggered = sense_sample() & SENSE_STOP_MASK & ~sense_state;
+  if (triggered) {
+    sense_state |= triggered;
+    sense_state_changed = true;
+  }
+  sense_debounce_start();
+}
+
+// A limit switch changed, homing gets every edge
+ISR(PCINT1_vect) {
+  stepper_limit_edge();
+  sense_pin_change();
+}
+
+// Door, chiller or power changed
+ISR(PCINT2_vect) {
+  sense_pin_change();
+}
+
+// The sensor pins were stable for the debounce time, releases of stop sensors take effect
+ISR(TIMER2_COMPA_vect) {
+  TCCR2B = 0;  // one-shot
+  uint8_t state = sense_sample();
+  if (state != sense_state) {
+    sense_state = state;
+    sense_state_changed = true;
+  }
 }
 
 
@@ -56,6 +164,7 @@ void control_init() {
   // TCCR0B = _BV(CS02) | _BV(CS00);    // 1024 => 31Hz
   // NOTES:
   // PPI = PWMfreq/(feedrate/25.4/60)
+  if (laser_interlock) { control_laser_interlock(true); }  // door open since sense_init()
 
   //// air and aux assist control
   ASSIST_DDR |= (1 << AIR_ASSIST_BIT);   // set as output pin
@@ -74,9 +183,33 @@ void control_init() {
 
 
 void control_laser_intensity(uint8_t intensity) {
+  if (laser_interlock) { intensity = 0; }
   OCR0A = intensity;
 }
 
+// OCR0A is double buffered in phase correct PWM and only takes effect at TOP, up to 8ms 
+// later. The interlock disconnects OC0A from the timer instead and drives PD6 low right away.
+void control_laser_interlock(bool enable) {
+  laser_interlock = enable;
+  if (enable) {
+    TCCR0A &= ~(1 << COM0A1);  // OC0A disconnected, PD6 is a plain output
+    PORTD &= ~(1 << PORTD6);
+    OCR0A = 0;
+  } else {
+    TCCR0A |= (1 << COM0A1);   // PWM on OC0A again, still at 0% until set
+  }
+}
+
+
+// Door opened, takes effect within microseconds instead of at the next step.
+// The motion decelerates to a feed hold, it resumes with the door closed.
+ISR(INT0_vect) {
+  if (!(SENSE_PIN & (1<<DOOR_BIT))) {  // the pin itself, the debounced state follows later
+    control_laser_interlock(true);
+    stepper_request_hold();
+  }
+}
+
 
 
 void control_air_assist(bool enable) {
@@ -23,27 +23,40 @@
 
 
 void sense_init();
-#define SENSE_X1_LIMIT !((LIMIT_PIN >> X1_LIMIT_BIT) & 1)
-#define SENSE_X2_LIMIT !((LIMIT_PIN >> X2_LIMIT_BIT) & 1)
-#define SENSE_Y1_LIMIT !((LIMIT_PIN >> Y1_LIMIT_BIT) & 1)
-#define SENSE_Y2_LIMIT !((LIMIT_PIN >> Y2_LIMIT_BIT) & 1)
-#define SENSE_Z1_LIMIT !((LIMIT_PIN >> Z1_LIMIT_BIT) & 1)
-#define SENSE_Z2_LIMIT !((LIMIT_PIN >> Z2_LIMIT_BIT) & 1)
-#define SENSE_CHILLER_OFF !((SENSE_PIN >> CHILLER_BIT) & 1)
-#define SENSE_DOOR_OPEN !((SENSE_PIN >> DOOR_BIT) & 1)
+bool sense_changed();  // true once after the sensor state changed
+
+// State of all sensors, a bit is set while the sensor triggers. Pin change interrupts keep 
+// it, reading it is a single byte. The limits are at their LIMIT_PIN bits. Stop sensors 
+// (SENSE_STOP_MASK) set their bit on the first active edge, everything else is debounced.
+extern volatile uint8_t sense_state;
+#define SENSE_CHILLER_OFF_BIT 6
+#define SENSE_DOOR_OPEN_BIT 7
+#ifndef DRIVEBOARD
+  #define SENSE_POWER_OFF_BIT 4
+#endif
+
+#define SENSE_X1_LIMIT (sense_state & (1<<X1_LIMIT_BIT))
+#define SENSE_X2_LIMIT (sense_state & (1<<X2_LIMIT_BIT))
+#define SENSE_Y1_LIMIT (sense_state & (1<<Y1_LIMIT_BIT))
+#define SENSE_Y2_LIMIT (sense_state & (1<<Y2_LIMIT_BIT))
+#define SENSE_Z1_LIMIT (sense_state & (1<<Z1_LIMIT_BIT))
+#define SENSE_Z2_LIMIT (sense_state & (1<<Z2_LIMIT_BIT))
+#define SENSE_CHILLER_OFF (sense_state & (1<<SENSE_CHILLER_OFF_BIT))
+#define SENSE_DOOR_OPEN (sense_state & (1<<SENSE_DOOR_OPEN_BIT))
+#define SENSE_LIMITS (sense_state & LIMIT_MASK)
+#define SENSE_ANY (sense_state)
 #ifdef DRIVEBOARD
   // invert door, remove power, add z_limits
-  #define SENSE_LIMITS (SENSE_X1_LIMIT || SENSE_X2_LIMIT || SENSE_Y1_LIMIT || SENSE_Y2_LIMIT || SENSE_Z1_LIMIT || SENSE_Z2_LIMIT)
-  #define SENSE_ANY (SENSE_LIMITS || SENSE_CHILLER_OFF || SENSE_DOOR_OPEN)
+  #define SENSE_STOP_MASK LIMIT_MASK  // sensors that stop the steppers
 #else
-  #define SENSE_POWER_OFF !((SENSE_PIN >> POWER_BIT) & 1)
-  #define SENSE_LIMITS (SENSE_X1_LIMIT || SENSE_X2_LIMIT || SENSE_Y1_LIMIT || SENSE_Y2_LIMIT)
-  #define SENSE_ANY (SENSE_LIMITS || SENSE_POWER_OFF || SENSE_CHILLER_OFF || SENSE_DOOR_OPEN)
+  #define SENSE_POWER_OFF (sense_state & (1<<SENSE_POWER_OFF_BIT))
+  #define SENSE_STOP_MASK (LIMIT_MASK|(1<<SENSE_POWER_OFF_BIT))
 #endif
 
 void control_init();
 
 void control_laser_intensity(uint8_t intensity);  //0-255 is 0-100%
+void control_laser_interlock(bool enable);  // forces the laser off while enabled
 
 void control_air_assist(bool enable);
 void control_aux1_assist(bool enable);
@@ -31,6 +31,7 @@
 
 #define CHAR_STOP '!'
 #define CHAR_RESUME '~'
+#define CHAR_FEED_HOLD '\x15'
 
 /** ring buffer **********************************
 * [_][h][e][l][l][o][_][_][_] -> wrap around     *
@@ -166,6 +167,10 @@ SIGNAL(USART_RX_vect) {
   } else if (data == CHAR_RESUME) {
     // special resume character, bypass buffer
     stepper_stop_resume();
+    stepper_hold_resume();
+  } else if (data == CHAR_FEED_HOLD) {
+    // special feed hold character, bypass buffer
+    stepper_request_hold();
   } else if (data == CHAR_REQUEST_READY) {
     if (rx_buffer_open_slots > RX_CHUNK_SIZE) {
       send_ready_flag = 1;
@@ -34,18 +34,61 @@
                              time ----->
 
   The speed profile starts at block->initial_rate, accelerates by block->rate_delta
-  during the first block->accelerate_until step_events_completed, then keeps going at constant speed until
-  step_events_completed reaches block->decelerate_after after which it decelerates until final_rate is reached.
+  during the first block->accelerate_until step events, then keeps going at constant speed until
+  block->decelerate_after after which it decelerates until final_rate is reached.
   The slope of acceleration is always +/- block->rate_delta and is applied at a constant rate following the midpoint rule.
   Speed adjustments are made ACCELERATION_TICKS_PER_SECOND times per second.  
+  All rates are steps/minute in fixed point with 8 fractional bits (Q24.8). The timer period of
+  a segment keeps 8 fractional bits of a timer tick as well, the ISR alternates between the two
+  neighboring ceilings such that the mean period is exact.
+
+  The profile is not traced by the stepper interrupt itself. Whenever the main loop waits, 
+  stepper_prepare_segments() cuts the blocks into segments of one acceleration tick each,
+  with their step count, timer setting and laser intensity precomputed. The stepper interrupt
+  only steps through these segments, keeping its work per step small and constant.
+
+  At low rates the steps of the minor axes of a line come in bursts, stepping together with
+  the major axis. Adaptive multi-axis step smoothing (AMASS) runs the bresenham tracer 2, 4 
+  or 8 times per major axis step in such segments, with correspondingly scaled counters. The
+  minor axes then step in between, evenly spread, while the major axis keeps its rate.
+
+  A feed hold decelerates from the rate of the latest prepared segment to a stop, along the
+  path and across blocks if needed. Opening the door cuts the laser and requests a hold. The
+  segments already prepared still run, the hold takes effect within SEGMENT_BUFFER_SIZE ticks.
+  Once stopped the block stays claimed. On resume the planner replans its rest from the rate
+  reached, then the preparation carries on.
+
+  With CONFIG_STEP_TIMED_RAMPS the rate in acceleration and deceleration segments does not 
+  change per tick but on every step, following the AVR446 recurrence c_n = c_(n-1) - 2c_(n-1)/(4n+1)
+  for the timer period c. Counting n in steps from standstill makes the velocity follow
+  v^2 = 2*a*n, exactly what the planner calculated the trapezoid with. It costs a 32 bit 
+  division per step in ramps, AMASS is not applied to them.
+
+  With CONFIG_S_CURVE the ramps take the same time (and with it the same steps) but follow
+  the smoothstep 3u^2-2u^3 instead of a straight line. The acceleration then builds up and 
+  fades out gradually (limited jerk) and peaks at 1.5 times the constant slope in the middle.
+
+  With CONFIG_INPUT_SHAPER the rate the steppers actually run at is the profile rate passed
+  through a ZV or ZVD shaper: the sum of delayed copies, spaced half a resonance period apart and
+  weighted such that the vibrations they excite cancel each other. The profile rate is sampled at
+  every segment, also while cruising, so the delayed copies continue across blocks.
+  All axes move along the same line and share the shaper. The shaped motion lags the profile by
+  the steps the delayed copies still owe, the deceleration starts that much earlier such that
+  the shaped tail comes to rest on the last step instead of being cut off.
+
+  Homing runs as planned moves too. While homing, a pin change interrupt watches the switches
+  of the move: an axis stops stepping at the edge of its switch and the move ends when all
+  of them are reached, throwing away the rest of it. The stepper interrupt latches the
+  position of a stopped axis at its next entry, without the step it had traced but not yet
+  pulsed, such that the position is exact to the step the switch changed on.
 */
 
-#define __DELAY_BACKWARD_COMPATIBLE__  // _delay_us() make backward compatible see delay.h
-  
 #include <math.h>
 #include <stdlib.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <string.h>
 #include "stepper.h"
 #include "config.h"
@@ -56,7 +99,73 @@
 
 
 #define CYCLES_PER_MICROSECOND (F_CPU/1000000)  //16000000/1000000 = 16
-#define CYCLES_PER_ACCELERATION_TICK (F_CPU/ACCELERATION_TICKS_PER_SECOND)  // 16MHz/100 = 160000
+#define RATE_PER_SEGMENT (60*ACCELERATION_TICKS_PER_SECOND*RATE_SCALE)  // (steps/min, Q24.8) that make one step per segment
+#define SEGMENT_BUFFER_SIZE 8  // segments prepared ahead of the stepper, 8 last 40ms at 200 ticks/s
+#define SHAPER_HISTORY 16  // segments the shaper looks back, power of 2
+#define AMASS_RATE (300000L*RATE_SCALE)  // (steps/min, Q24.8) 5kHz, slower segments step at multiples of their rate up to this
+#define MINIMUM_RATE (MINIMUM_STEPS_PER_MINUTE*RATE_SCALE)  // (steps/min, Q24.8)
+#define MINIMUM_STEP_CYCLES ((2*CONFIG_PULSE_MICROSECONDS + 3)*CYCLES_PER_MICROSECOND)  // shortest step period, low and high phase of a pulse plus the ISR checks
+#define CYCLES_PER_MINUTE_Q14 ((CYCLES_PER_MICROSECOND*1000000*60 + 8192) >> 14)  // 58594, fits 16 bit
+
+#define HOLD_OFF 0            // running as planned
+#define HOLD_DECELERATING 1   // feed hold, slowing down to a stop
+#define HOLD_STOPPED 2        // feed hold, no more segments until resumed
+
+#define SEGMENT_FIRST (1<<0)  // first segment of a block
+#define SEGMENT_LAST (1<<1)   // last segment of a block
+#define SEGMENT_RAMP (1<<2)   // steps are timed by the ramp recurrence, CONFIG_STEP_TIMED_RAMPS
+#define SEGMENT_RAMP_START (1<<3)  // first segment of a ramp, carries its initial state
+
+#if defined(CONFIG_STEP_TIMED_RAMPS) && (defined(CONFIG_S_CURVE) || defined(CONFIG_INPUT_SHAPER))
+  #error "CONFIG_STEP_TIMED_RAMPS can not be combined with CONFIG_S_CURVE or CONFIG_INPUT_SHAPER"
+#endif
+#if defined(CONFIG_HOMING_Z) && !defined(DRIVEBOARD)
+  #error "CONFIG_HOMING_Z needs the z limit switches of the DRIVEBOARD"
+#endif
+
+// Step tracers, picked per block to do only what the block needs
+#define TRACE_SINGLE_AXIS 0   // one axis moving, steps on every step event
+#define TRACE_XY_16 1         // z not moving, less than 2^15 scaled step events
+#define TRACE_XYZ_16 2        // less than 2^15 scaled step events
+#define TRACE_XY_32 3         // z not moving
+#define TRACE_XYZ_32 4
+
+// One bresenham step of an axis, also keeps track of the absolute position
+#define TRACE_AXIS(counter, steps, event_count, step_bit, axis) \
+  counter += steps; \
+  if (counter > 0) { \
+    out_bits |= (1<<step_bit); \
+    counter -= event_count; \
+    stepper_position[axis] += position_increment[axis]; \
+  }
+
+// Reciprocals 2^22/m of normalized rates m = 128..256, see set_segment_timer()
+#define RECIPROCAL(m) ((uint16_t)((4194304L + (m)/2)/(m)))
+#define RECIPROCAL4(m) RECIPROCAL(m), RECIPROCAL(m+1), RECIPROCAL(m+2), RECIPROCAL(m+3)
+#define RECIPROCAL16(m) RECIPROCAL4(m), RECIPROCAL4(m+4), RECIPROCAL4(m+8), RECIPROCAL4(m+12)
+static const uint16_t reciprocal_table[129] PROGMEM = {
+  RECIPROCAL16(128), RECIPROCAL16(144), RECIPROCAL16(160), RECIPROCAL16(176), 
+  RECIPROCAL16(192), RECIPROCAL16(208), RECIPROCAL16(224), RECIPROCAL16(240), 
+  RECIPROCAL(256)
+};
+
+// A run of step events of one block at constant rate
+typedef struct {
+  block_t *block;               // The block the step events belong to
+  uint16_t step_count;          // The number of step events
+  uint16_t timer_ceiling;       // OCR1A for the step rate
+  uint8_t timer_fraction;       // Fraction of a timer tick the period is longer, 1/256 units
+  uint8_t timer_prescaler;      // Clock select bits of TCCR1B for the step rate
+  uint8_t timer_postscaler;     // Timer periods skipped per step event, for rates below the timer's range
+  uint8_t intensity;            // Laser intensity
+  uint8_t pwm_prescaler;        // Clock select bits of TCCR0B, PWM frequency for the intensity
+  uint8_t amass_level;          // The step events are 2^amass_level times the major axis steps
+  uint8_t flags;                // SEGMENT_FIRST, SEGMENT_LAST, SEGMENT_RAMP, SEGMENT_RAMP_START
+  #ifdef CONFIG_STEP_TIMED_RAMPS
+  uint32_t ramp_period;         // Cycles to the next step at the start of a ramp
+  int32_t ramp_n;               // Step index of the ramp start, negative when decelerating
+  #endif
+} segment_t;
 
 
 static int32_t stepper_position[3];  // real-time position in absolute steps
@@ -67,23 +176,101 @@ static uint8_t out_bits;       // The next stepping-bits to be output
 static int32_t counter_x,       // Counter variables for the bresenham line tracer
                counter_y,
                counter_z;
-static uint32_t step_events_completed; // The number of step events executed in the current block
+static uint32_t trace_steps_x,  // Steps of the current block, scaled to the AMASS level of the segment
+                trace_steps_y,
+                trace_steps_z;
+static uint32_t trace_event_count;  // Step events of the current block, scaled to the top AMASS level
+static int16_t counter16_x,     // Counter variables for the 16 bit bresenham line tracer
+               counter16_y,
+               counter16_z;
+static int16_t trace16_steps_x, // 16 bit copies of the scaled steps for the 16 bit tracer
+               trace16_steps_y,
+               trace16_steps_z,
+               trace16_event_count;
+static uint8_t trace_routine;                 // TRACE_* used for the current block
+static uint8_t single_axis;                   // The moving axis for TRACE_SINGLE_AXIS
+static uint8_t single_step_bits;              // Its step bit
+static int8_t position_increment[3];          // +1 or -1 per axis, direction of the current block
+#ifdef CONFIG_STEP_TIMED_RAMPS
+static int32_t ramp_period;                   // Cycles to the next step in the current ramp
+static int32_t ramp_remainder;                // Remainder of the recurrence, carried for accuracy
+static int32_t ramp_n;                        // Steps from standstill, negative when decelerating
+#endif
+static uint16_t timer_ceiling;                // OCR1A of the current segment
+static uint8_t timer_fraction;                // Its fraction of a timer tick, dithered in
+static uint8_t timer_dither;                  // Accumulated fraction, its carry lengthens a period by one tick
+static uint8_t step_postscaler;               // Timer periods to skip per step event in the current segment
+static uint8_t postscaler_count;              // Timer periods left to skip before the next step event
+static segment_t *current_segment;           // A pointer to the segment currently being traced
+static uint16_t segment_steps_remaining;     // The number of step events left in the current segment
 static volatile uint8_t busy;  // true whe stepper ISR is in already running
-
-// Variables used by the trapezoid generation
-static uint32_t cycles_per_step_event;        // The number of machine cycles between each step event
-static uint32_t acceleration_tick_counter;    // The cycles since last acceleration_tick.
-                                              // Used to generate ticks at a steady pace without allocating a separate timer.
-static uint32_t adjusted_rate;                // The current rate of step_events according to the speed profile
 static bool processing_flag;                  // indicates if blocks are being processed
 static volatile bool stop_requested;          // when set to true stepper interrupt will go idle on next entry
 static volatile uint8_t stop_status;          // yields the reason for a stop request
+static volatile bool hold_requested;          // set for a feed hold, cleared to resume
+static volatile uint8_t homing_limit_bits;    // limit switches ending the current homing move, 0 when not homing
+static volatile bool homing_release;          // the homing move waits for its switches to release instead
+static volatile uint8_t homing_reached_bits;  // switches of the homing move reached so far
+static volatile uint8_t homing_ignore_bits;   // limit switches of the homed axes, these do not stop a homing move
+static volatile uint8_t homing_locked_bits;   // step bits of the axes at their switch, these no longer step
+static uint8_t homing_latched_bits;           // step bits of the locked axes with a latched position
+static int32_t homing_latch[3];               // position of each locked axis when its switch was reached
+
+// Segments are prepared in the main loop and executed in the stepper interrupt
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE];  // ring buffer of segments
+static volatile uint8_t segment_buffer_head;  // index of the next segment to be prepared
+static volatile uint8_t segment_buffer_tail;  // index of the segment to execute now
+static volatile bool segment_buffer_flushed;  // set by a stop, the preparation starts over
+static volatile bool segment_buffer_starved;  // set by the ISR when it ran out of segments mid-motion
+
+// Variables used by the segment preparation
+static block_t *prep_block;                   // The block being cut into segments
+static uint32_t prep_step_events;             // The number of step events of prep_block already prepared
+static int32_t prep_step_fraction;            // Fraction of a step carried to the next segment, RATE_PER_SEGMENT is one step
+static uint32_t prep_rate;                    // The profile rate of the latest segment
+static bool prep_decelerating;                // the deceleration ramp of prep_block has started
+static bool prep_multi_axis;                  // more than one axis moves in prep_block, AMASS applies
+static uint8_t hold_state;                    // HOLD_OFF, HOLD_DECELERATING or HOLD_STOPPED
+static bool prep_resumed;                     // prep_block was replanned after a feed hold
+static bool resume_pending;                   // the next block gets replanned, the hold ended between blocks
+static double prep_exit_speed;                // (mm/min) speed at the end of the latest prepared block
+static uint16_t prep_intensity_factor;        // Laser intensity per (rate >> prep_rate_shift), 4096 is 1.0
+static uint8_t prep_rate_shift;               // Brings the nominal rate of prep_block below 256
+static uint32_t ramp_start_rate;              // The rate at the start of the current ramp
+static uint32_t ramp_target_rate;             // The rate at the end of the current ramp
+static uint16_t ramp_ticks;                   // Length of the current ramp in segments
+static uint16_t ramp_tick_count;              // Segments since the start of the current ramp
+#ifdef CONFIG_INPUT_SHAPER
+static uint32_t shaper_history[SHAPER_HISTORY]; // Profile rates of the last segments
+static uint16_t shaper_weights[SHAPER_HISTORY]; // Weight of each past segment, 256 is 1.0
+static uint8_t shaper_newest;                 // Index of the latest profile rate in shaper_history
+#endif
 
 
 // prototypes for static functions (non-accesible from other files)
-static bool acceleration_tick();
-static void adjust_speed( uint32_t steps_per_minute );
-static uint32_t config_step_timer(uint32_t cycles);
+static uint8_t next_segment_index(uint8_t segment_index);
+static void prep_begin_profile(uint32_t rate);
+static void prep_restart_from_rest();
+static void ramp_begin(uint32_t start_rate, uint32_t target_rate);
+static uint32_t ramp_rate();
+static void shaper_init();
+static void shaper_reset(uint32_t rate);
+static uint32_t shaped_rate(uint32_t rate);
+static uint32_t shaper_lag();
+static void set_segment_timer(segment_t *segment, uint32_t steps_per_minute);
+static void set_segment_intensity(segment_t *segment, uint32_t steps_per_minute);
+static void step_timer_setting(uint32_t cycles, uint8_t cycle_fraction, uint8_t *timer_prescaler, 
+                               uint16_t *timer_ceiling, uint8_t *timer_fraction, uint8_t *timer_postscaler);
+static void config_step_timer(uint8_t prescaler, uint16_t ceiling);
+#ifdef CONFIG_STEP_TIMED_RAMPS
+static void set_segment_ramp(segment_t *segment, bool decelerating);
+#endif
+static void execute_assist_commands(uint8_t assist_on_bits, uint8_t assist_off_bits);
+static void homing_check_switches();
+static void homing_latch_positions(uint8_t latch_bits);
+static bool homing_move(uint8_t limit_bits, bool release, double distance, double feed_rate);
+static bool homing_axes(uint8_t limit_bits);
+static bool homing_switches_settled(uint8_t limit_bits);
 
 
 
@@ -102,21 +289,24 @@ void stepper_init() {
   // output mode = 00 (disconnected)
   TCCR1A &= ~(3<<COM1A0);
   TCCR1A &= ~(3<<COM1B0);
-
-  // Configure Timer 2
-  TCCR2A = 0; // Normal operation
-  TCCR2B = 0; // Disable timer until needed.
-  TIMSK2 |= (1<<TOIE2); // Enable Timer2 interrupt flag
   
-  adjust_speed(MINIMUM_STEPS_PER_MINUTE);
+  shaper_init();
+  segment_buffer_head = 0;
+  segment_buffer_tail = 0;
+  segment_buffer_flushed = false;
+  segment_buffer_starved = false;
+  prep_block = NULL;
   clear_vector(stepper_position);
   stepper_set_position( CONFIG_X_ORIGIN_OFFSET, 
                         CONFIG_Y_ORIGIN_OFFSET, 
                         CONFIG_Z_ORIGIN_OFFSET );
-  acceleration_tick_counter = 0;
   current_block = NULL;
+  current_segment = NULL;
   stop_requested = false;
   stop_status = STATUS_OK;
+  hold_requested = false;
+  hold_state = HOLD_OFF;
+  resume_pending = false;
   busy = false;
   
   // start in the idle state
@@ -128,6 +318,7 @@ void stepper_init() {
 // block until all command blocks are executed
 void stepper_synchronize() {
   while(processing_flag) { 
+    stepper_prepare_segments();
     // sleep_mode();
   }
 }
@@ -139,6 +330,8 @@ void stepper_wake_up() {
     processing_flag = true;
     // Initialize stepper output bits
     out_bits = INVERT_MASK;
+    step_postscaler = 0;
+    postscaler_count = 0;
     // Enable stepper driver interrupt
     TIMSK1 |= (1<<OCIE1A);
   }
@@ -149,8 +342,11 @@ void stepper_wake_up() {
 void stepper_go_idle() {
   processing_flag = false;
   current_block = NULL;
+  current_segment = NULL;
   // Disable stepper driver interrupt
   TIMSK1 &= ~(1<<OCIE1A);
+  // end a step pulse still up
+  STEPPING_PORT = (STEPPING_PORT & ~STEPPING_MASK) | (INVERT_MASK & STEPPING_MASK);
   control_laser_intensity(0);
 }
 
@@ -172,17 +368,46 @@ void stepper_stop_resume() {
   stop_requested = false;
 }
 
+// feed hold, slows down to a stop along the path and keeps the plan
+void stepper_request_hold() {
+  hold_requested = true;
+}
+
+bool stepper_hold_requested() {
+  return hold_requested;
+}
+
+void stepper_hold_resume() {
+  #ifndef DEBUG_IGNORE_SENSORS
+    if (SENSE_DOOR_OPEN) { return; }  // close the door first
+  #endif
+  control_laser_interlock(false);
+  hold_requested = false;
+}
+
 
 
 
+// the stepper interrupt changes the position while it is read byte by byte
+void stepper_get_position_steps(int32_t *steps) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memcpy(steps, stepper_position, sizeof(stepper_position));
+  }
+}
 double stepper_get_position_x() {
-  return stepper_position[X_AXIS]/CONFIG_X_STEPS_PER_MM;
+  int32_t steps;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { steps = stepper_position[X_AXIS]; }
+  return steps/CONFIG_X_STEPS_PER_MM;
 }
 double stepper_get_position_y() {
-  return stepper_position[Y_AXIS]/CONFIG_Y_STEPS_PER_MM;
+  int32_t steps;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { steps = stepper_position[Y_AXIS]; }
+  return steps/CONFIG_Y_STEPS_PER_MM;
 }
 double stepper_get_position_z() {
-  return stepper_position[Z_AXIS]/CONFIG_Z_STEPS_PER_MM;
+  int32_t steps;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { steps = stepper_position[Z_AXIS]; }
+  return steps/CONFIG_Z_STEPS_PER_MM;
 }
 void stepper_set_position(double x, double y, double z) {
   stepper_synchronize();  // wait until processing is done
@@ -194,27 +419,24 @@ void stepper_set_position(double x, double y, double z) {
 
 
 
-// The Stepper Reset ISR
-// It resets the motor port after a short period completing one step cycle.
-// TODO: It is possible for the serial interrupts to delay this interrupt by a few microseconds, if
-// they execute right before this interrupt. Not a big deal, but could use some TLC at some point.
-ISR(TIMER2_OVF_vect) {
-  // reset step pins
-  STEPPING_PORT = (STEPPING_PORT & ~STEPPING_MASK) | (INVERT_MASK & STEPPING_MASK);
-  TCCR2B = 0; // Disable Timer2 to prevent re-entering this interrupt when it's not needed. 
-}
-  
-
 // The Stepper ISR
 // This is the workhorse of LasaurGrbl. It is executed at the rate set with
-// config_step_timer. It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately.
+// config_step_timer. It pops segments from the segment_buffer and executes them by pulsing the stepper pins appropriately.
 // The bresenham line tracer algorithm controls all three stepper outputs simultaneously.
+// Step pulses take this one interrupt only. The pins fall at the start of the interrupt and rise
+// with the step at least CONFIG_PULSE_MICROSECONDS later, they stay up for the rest of the step
+// period. Step periods are at least MINIMUM_STEP_CYCLES, the high phase is as long as the low one.
 ISR(TIMER1_COMPA_vect) {
   if (busy) { return; } // The busy-flag is used to avoid reentering this interrupt
   busy = true;
+  // end the previous step pulse and set the direction of the next step ahead of it
+  STEPPING_PORT = (STEPPING_PORT & ~(STEPPING_MASK | DIRECTION_MASK)) | 
+                  (out_bits & DIRECTION_MASK) | (INVERT_MASK & STEPPING_MASK);
   if (stop_requested) {
-    // go idle and absorb any blocks
+    // go idle and absorb any blocks and segments
     stepper_go_idle(); 
+    segment_buffer_tail = segment_buffer_head;
+    segment_buffer_flushed = true;
     planner_reset_block_buffer();
     planner_request_position_update();
     gcode_request_position_update();
@@ -222,28 +444,53 @@ ISR(TIMER1_COMPA_vect) {
     return;
   }
 
+  if (homing_limit_bits) {
+    // axes stop at their homing switch, latch where and drop their pending step
+    uint8_t latch_bits = homing_locked_bits & ~homing_latched_bits;
+    if (latch_bits) { homing_latch_positions(latch_bits); }
+    out_bits &= ~homing_locked_bits;
+    // a homing move ends when all its axes are at their switch
+    if (homing_reached_bits == homing_limit_bits) {
+      stepper_go_idle(); 
+      segment_buffer_tail = segment_buffer_head;
+      segment_buffer_flushed = true;
+      planner_reset_block_buffer();
+      homing_limit_bits = 0;
+      busy = false;
+      return;
+    }
+  }
+
   #ifndef DEBUG_IGNORE_SENSORS
-    // stop program when any limit is hit or the e-stop turned the power off
-    if (SENSE_LIMITS) {
-      stepper_request_stop(STATUS_LIMIT_HIT);
+    // stop program when any limit is hit or the e-stop turned the power off, one test
+    // of the debounced sensor state, the switches of a homing move do not count
+    uint8_t stop_sensors = sense_state & SENSE_STOP_MASK & ~homing_ignore_bits;
+    if (stop_sensors) {
+      stepper_request_stop((stop_sensors & LIMIT_MASK) ? STATUS_LIMIT_HIT : STATUS_POWER_OFF);
       busy = false;
       return;    
     }
-    #ifndef DRIVEBOARD
-      else if (SENSE_POWER_OFF) {
-        stepper_request_stop(STATUS_POWER_OFF);
-        busy = false;
-        return;
-      }
-    #endif
   #endif
   
-  // pulse steppers
-  STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | (out_bits & DIRECTION_MASK);
-  STEPPING_PORT = (STEPPING_PORT & ~STEPPING_MASK) | out_bits;
-  // prime for reset pulse in CONFIG_PULSE_MICROSECONDS
-  TCNT2 = -(((CONFIG_PULSE_MICROSECONDS-2)*CYCLES_PER_MICROSECOND) >> 3); // Reload timer counter
-  TCCR2B = (1<<CS21); // Begin timer2. Full speed, 1/8 prescaler
+  // dither the period between ceiling and ceiling+1, the mean is the exact fractional period
+  if (timer_fraction) {
+    uint8_t dither = timer_dither + timer_fraction;
+    OCR1A = timer_ceiling + (dither < timer_dither);
+    timer_dither = dither;
+  }
+
+  // slow step events last several timer periods
+  if (postscaler_count > 0) {
+    postscaler_count--;
+    busy = false;
+    return;
+  }
+  postscaler_count = step_postscaler;
+
+  // pulse steppers, the pins were low since the start of this interrupt, keep them low for
+  // the pulse width whatever the checks above took, drivers miss steps with a shorter low phase
+  if (out_bits & STEPPING_MASK) { _delay_us(CONFIG_PULSE_MICROSECONDS); }
+  STEPPING_PORT = (STEPPING_PORT & ~STEPPING_MASK) | (out_bits & STEPPING_MASK);
 
   // Enable nested interrupts.
   // By default nested interrupts are disabled but can be enabled with sei()
@@ -251,324 +498,805 @@ ISR(TIMER1_COMPA_vect) {
   // See: http://avr-libc.nongnu.org/user-manual/group__avr__interrupts.html
   sei();
 
-  // If there is no current block, attempt to pop one from the buffer
-  if (current_block == NULL) {
+  #ifdef CONFIG_STEP_TIMED_RAMPS
+    bool ramp_advance = true;
+  #endif
+
+  // If there is no current segment, attempt to pop one from the buffer
+  if (current_segment == NULL) {
     // Anything in the buffer?
-    current_block = planner_get_current_block();
-    // if still no block command, go idle, disable interrupt
-    if (current_block == NULL) {
-      stepper_go_idle();
+    if (segment_buffer_head == segment_buffer_tail) {
+      if (planner_get_current_block() == NULL) {
+        // all blocks done, go idle, disable interrupt
+        // commands queued after the last line execute now that its motion is done
+        uint8_t assist_on_bits, assist_off_bits;
+        planner_take_pending_commands(&assist_on_bits, &assist_off_bits);
+        execute_assist_commands(assist_on_bits, assist_off_bits);
+        stepper_go_idle();
+      } else {
+        // the main loop has not prepared the next segment yet, wait for it without lasing,
+        // the axes stand still now and the preparation restarts the profile from rest
+        segment_buffer_starved = true;
+        out_bits = INVERT_MASK;  // no steps on the next interrupt
+        control_laser_intensity(0);
+        config_step_timer((1<<CS11), CYCLES_PER_MICROSECOND*1000/8);  // check again in 1ms
+        timer_fraction = 0;
+        step_postscaler = 0;
+        postscaler_count = 0;
+      }
       busy = false;
       return;       
-    }      
-    if (current_block->type == TYPE_LINE) {  // starting on new line block
-      adjusted_rate = current_block->initial_rate;
-      acceleration_tick_counter = CYCLES_PER_ACCELERATION_TICK/2; // start halfway, midpoint rule.
-      adjust_speed( adjusted_rate ); // initialize cycles_per_step_event
-      counter_x = -(current_block->step_event_count >> 1);
+    }
+    current_segment = &segment_buffer[segment_buffer_tail];
+    #ifdef CONFIG_STEP_TIMED_RAMPS
+      if (current_segment->flags & SEGMENT_RAMP_START) {
+        ramp_period = current_segment->ramp_period;
+        ramp_remainder = 0;
+        ramp_n = current_segment->ramp_n;
+        ramp_advance = false;  // the initial period is for this step already
+      }
+      if (!(current_segment->flags & SEGMENT_RAMP) || !ramp_advance) {
+        config_step_timer(current_segment->timer_prescaler, current_segment->timer_ceiling);
+        timer_ceiling = current_segment->timer_ceiling;
+        timer_fraction = current_segment->timer_fraction;
+        step_postscaler = current_segment->timer_postscaler;
+        postscaler_count = step_postscaler;
+      }
+    #else
+      config_step_timer(current_segment->timer_prescaler, current_segment->timer_ceiling);
+      timer_ceiling = current_segment->timer_ceiling;
+      timer_fraction = current_segment->timer_fraction;
+      step_postscaler = current_segment->timer_postscaler;
+      postscaler_count = step_postscaler;
+    #endif
+    control_laser_intensity(current_segment->intensity);
+    TCCR0B = current_segment->pwm_prescaler;
+    if (current_segment->flags & SEGMENT_FIRST) {
+      // starting on new line block, execute its commands right before its first step
+      current_block = current_segment->block;
+      execute_assist_commands(current_block->assist_on_bits, current_block->assist_off_bits);
+      trace_event_count = current_block->step_event_count << CONFIG_AMASS_LEVELS;
+      counter_x = -(trace_event_count >> 1);
       counter_y = counter_x;
       counter_z = counter_x;
-      step_events_completed = 0;
+      position_increment[X_AXIS] = (current_block->direction_bits & (1<<X_DIRECTION_BIT)) ? -1 : 1;
+      position_increment[Y_AXIS] = (current_block->direction_bits & (1<<Y_DIRECTION_BIT)) ? -1 : 1;
+      position_increment[Z_AXIS] = (current_block->direction_bits & (1<<Z_DIRECTION_BIT)) ? -1 : 1;
+      // pick the tracer
+      if (current_block->steps_x == current_block->step_event_count && 
+          current_block->steps_y == 0 && current_block->steps_z == 0) {
+        trace_routine = TRACE_SINGLE_AXIS;
+        single_axis = X_AXIS;
+        single_step_bits = (1<<X_STEP_BIT);
+      } else if (current_block->steps_y == current_block->step_event_count && 
+                 current_block->steps_x == 0 && current_block->steps_z == 0) {
+        trace_routine = TRACE_SINGLE_AXIS;
+        single_axis = Y_AXIS;
+        single_step_bits = (1<<Y_STEP_BIT);
+      } else if (current_block->steps_z == current_block->step_event_count && 
+                 current_block->steps_x == 0 && current_block->steps_y == 0) {
+        trace_routine = TRACE_SINGLE_AXIS;
+        single_axis = Z_AXIS;
+        single_step_bits = (1<<Z_STEP_BIT);
+      } else if (trace_event_count < 0x8000) {
+        counter16_x = counter_x;
+        counter16_y = counter_x;
+        counter16_z = counter_x;
+        trace16_event_count = trace_event_count;
+        if (current_block->steps_z == 0) { trace_routine = TRACE_XY_16; }
+        else { trace_routine = TRACE_XYZ_16; }
+      } else {
+        if (current_block->steps_z == 0) { trace_routine = TRACE_XY_32; }
+        else { trace_routine = TRACE_XYZ_32; }
+      }
+    }
+    // at AMASS level n the major axis steps every 2^n step events
+    uint8_t amass_shift = CONFIG_AMASS_LEVELS - current_segment->amass_level;
+    trace_steps_x = current_block->steps_x << amass_shift;
+    trace_steps_y = current_block->steps_y << amass_shift;
+    trace_steps_z = current_block->steps_z << amass_shift;
+    trace16_steps_x = trace_steps_x;
+    trace16_steps_y = trace_steps_y;
+    trace16_steps_z = trace_steps_z;
+    segment_steps_remaining = current_segment->step_count;
+  }
+
+  #ifdef CONFIG_STEP_TIMED_RAMPS
+    if ((current_segment->flags & SEGMENT_RAMP) && ramp_advance) {
+      // period to the next step, AVR446 recurrence
+      ramp_n++;
+      if (ramp_n == 0) { ramp_n = -1; }  // reaching standstill, keep slowing down
+      int32_t numerator = 2*ramp_period + ramp_remainder;
+      int32_t denominator = 4*ramp_n + 1;
+      ramp_period -= numerator / denominator;
+      ramp_remainder = numerator % denominator;
+      // into the timer statics, the dither at the next entry rewrites OCR1A from them
+      uint8_t prescaler;
+      step_timer_setting(ramp_period, 0, &prescaler, &timer_ceiling, &timer_fraction, &step_postscaler);
+      config_step_timer(prescaler, timer_ceiling);
+      postscaler_count = step_postscaler;
+    }
+  #endif
+
+  ////// Execute step displacement profile by bresenham line algorithm
+  out_bits = current_block->direction_bits;
+  switch (trace_routine) {
+    case TRACE_SINGLE_AXIS:
+      out_bits |= single_step_bits;
+      stepper_position[single_axis] += position_increment[single_axis];
+      break;
+    case TRACE_XY_16:
+      TRACE_AXIS(counter16_x, trace16_steps_x, trace16_event_count, X_STEP_BIT, X_AXIS)
+      TRACE_AXIS(counter16_y, trace16_steps_y, trace16_event_count, Y_STEP_BIT, Y_AXIS)
+      break;
+    case TRACE_XYZ_16:
+      TRACE_AXIS(counter16_x, trace16_steps_x, trace16_event_count, X_STEP_BIT, X_AXIS)
+      TRACE_AXIS(counter16_y, trace16_steps_y, trace16_event_count, Y_STEP_BIT, Y_AXIS)
+      TRACE_AXIS(counter16_z, trace16_steps_z, trace16_event_count, Z_STEP_BIT, Z_AXIS)
+      break;
+    case TRACE_XY_32:
+      TRACE_AXIS(counter_x, trace_steps_x, trace_event_count, X_STEP_BIT, X_AXIS)
+      TRACE_AXIS(counter_y, trace_steps_y, trace_event_count, Y_STEP_BIT, Y_AXIS)
+      break;
+    default:
+      TRACE_AXIS(counter_x, trace_steps_x, trace_event_count, X_STEP_BIT, X_AXIS)
+      TRACE_AXIS(counter_y, trace_steps_y, trace_event_count, Y_STEP_BIT, Y_AXIS)
+      TRACE_AXIS(counter_z, trace_steps_z, trace_event_count, Z_STEP_BIT, Z_AXIS)
+  }
+  //////
+  
+  // apply stepper invert mask
+  out_bits ^= INVERT_MASK;
+
+  segment_steps_remaining--;
+  if (segment_steps_remaining == 0) {  // segment finished
+    if (current_segment->flags & SEGMENT_LAST) {  // block finished
+      current_block = NULL;
+      planner_discard_current_block();
     }
+    current_segment = NULL;
+    segment_buffer_tail = next_segment_index( segment_buffer_tail );
   }
+  
+  busy = false;
+}
+
+
 
-  // process current block, populate out_bits (or handle other commands)
-  switch (current_block->type) {
-    case TYPE_LINE:
-      ////// Execute step displacement profile by bresenham line algorithm
-      out_bits = current_block->direction_bits;
-      counter_x += current_block->steps_x;
-      if (counter_x > 0) {
-        out_bits |= (1<<X_STEP_BIT);
-        counter_x -= current_block->step_event_count;
-        // also keep track of absolute position
-        if ((out_bits >> X_DIRECTION_BIT) & 1 ) {
-          stepper_position[X_AXIS] -= 1;
-        } else {
-          stepper_position[X_AXIS] += 1;
-        }        
+
+// Cuts the planned blocks into segments for the stepper interrupt until the segment buffer
+// is full. This runs the speed profile (and shaper) one acceleration tick per segment: the
+// rate is evaluated for the middle of the tick and the steps that fit in the tick at this 
+// rate go into the segment. Segments end early at the phase boundaries of the block, the 
+// unused fraction of the tick carries over. At rates below one step per tick segments are 
+// stretched to one step, the ramps then progress once per step like the old interrupt did.
+void stepper_prepare_segments() {
+  planner_prepare_blocks();
+  for (;;) {
+    uint8_t next_buffer_head = next_segment_index( segment_buffer_head );
+    if (next_buffer_head == segment_buffer_tail) { return; }  // buffer full
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (segment_buffer_flushed) {  // a stop purged all blocks
+        prep_block = NULL;
+        segment_buffer_flushed = false;
+        segment_buffer_starved = false;
+        hold_state = HOLD_OFF;  // a requested hold still applies to what comes next
+        resume_pending = false;
       }
-      counter_y += current_block->steps_y;
-      if (counter_y > 0) {
-        out_bits |= (1<<Y_STEP_BIT);
-        counter_y -= current_block->step_event_count;
-        // also keep track of absolute position
-        if ((out_bits >> Y_DIRECTION_BIT) & 1 ) {
-          stepper_position[Y_AXIS] -= 1;
-        } else {
-          stepper_position[Y_AXIS] += 1;
-        }        
+    }
+
+    // feed hold and resume
+    if (hold_requested && (hold_state == HOLD_OFF)) {
+      hold_state = HOLD_DECELERATING;
+      if (prep_block != NULL) { ramp_begin(prep_rate, 0); }
+    } else if (!hold_requested && (hold_state != HOLD_OFF)) {
+      hold_state = HOLD_OFF;
+      if (prep_block != NULL) {
+        // replan the rest of the block from the rate reached
+        planner_resume_block(prep_block, prep_step_events, prep_rate);
+        prep_begin_profile(prep_rate);
+        prep_resumed = true;
+      } else {
+        resume_pending = true;
       }
-      counter_z += current_block->steps_z;
-      if (counter_z > 0) {
-        out_bits |= (1<<Z_STEP_BIT);
-        counter_z -= current_block->step_event_count;
-        // also keep track of absolute position        
-        if ((out_bits >> Z_DIRECTION_BIT) & 1 ) {
-          stepper_position[Z_AXIS] -= 1;
-        } else {
-          stepper_position[Z_AXIS] += 1;
-        }        
+    }
+    if (hold_state == HOLD_STOPPED) { return; }
+
+    if (prep_block == NULL) {
+      prep_block = planner_claim_next_block();
+      if (prep_block == NULL) { return; }  // nothing planned, or trapezoid not ready
+      prep_step_events = 0;
+      prep_resumed = false;
+      prep_multi_axis = ((prep_block->steps_x > 0) + (prep_block->steps_y > 0) + (prep_block->steps_z > 0)) > 1;
+      // beam dynamics, intensity proportional to the rate, in fixed point
+      prep_rate_shift = 0;
+      while ((prep_block->nominal_rate >> prep_rate_shift) > 0xff) { prep_rate_shift++; }
+      uint8_t shifted_rate = prep_block->nominal_rate >> prep_rate_shift;
+      uint32_t intensity_factor = (((uint32_t)prep_block->nominal_laser_intensity << 12) + shifted_rate/2) / 
+                                  shifted_rate;
+      prep_intensity_factor = min(intensity_factor, 0xffff);  // clips only for nominal rates below 1/16 steps/min
+      uint32_t rate = prep_block->initial_rate;
+      if ((hold_state != HOLD_OFF) || resume_pending) {
+        // continue from the speed the previous block ended with, not as planned
+        rate = min(rate, lround(prep_exit_speed * prep_block->nominal_rate / prep_block->nominal_speed));
       }
-      //////
-      
-      step_events_completed++;  // increment step count
-      
-      // apply stepper invert mask
-      out_bits ^= INVERT_MASK;
-
-      ////////// SPEED ADJUSTMENT
-      if (step_events_completed < current_block->step_event_count) {  // block not finished
-      
-        // accelerating
-        if (step_events_completed < current_block->accelerate_until) {
-          if ( acceleration_tick() ) {  // scheduled speed change
-            adjusted_rate += current_block->rate_delta;
-            if (adjusted_rate > current_block->nominal_rate) {  // overshot
-              adjusted_rate = current_block->nominal_rate;
-            }
-            adjust_speed( adjusted_rate );
-          }
-        
-        // deceleration start
-        } else if (step_events_completed == current_block->decelerate_after) {
-            // reset counter, midpoint rule
-            // makes sure deceleration is performed the same every time
-            acceleration_tick_counter = CYCLES_PER_ACCELERATION_TICK/2;
-                 
-        // decelerating
-        } else if (step_events_completed >= current_block->decelerate_after) {
-          if ( acceleration_tick() ) {  // scheduled speed change
-            adjusted_rate -= current_block->rate_delta;
-            if (adjusted_rate < current_block->final_rate) {  // overshot
-              adjusted_rate = current_block->final_rate;
-            }
-            adjust_speed( adjusted_rate );
-          }
-        
-        // cruising
-        } else {
-          // No accelerations. Make sure we cruise exactly at the nominal rate.
-          if (adjusted_rate != current_block->nominal_rate) {
-            adjusted_rate = current_block->nominal_rate;
-            adjust_speed( adjusted_rate );
-          }
+      if (hold_state != HOLD_OFF) {
+        prep_rate = rate;
+        ramp_begin(rate, 0);
+      } else {
+        if (resume_pending) {
+          planner_resume_block(prep_block, 0, rate);
+          resume_pending = false;
+          prep_resumed = true;
         }
-      } else {  // block finished
-        current_block = NULL;
-        planner_discard_current_block();
+        prep_begin_profile(rate);
       }
-      ////////// END OF SPEED ADJUSTMENT
-    
-      break; 
+    }
 
-    case TYPE_AIR_ASSIST_ENABLE:
-      control_air_assist(true);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;
+    // profile rate of this segment and where its phase ends, the profile is ahead of the 
+    // steps by the shaper lag, the deceleration has to end with the shaped steps
+    uint32_t lag = shaper_lag();
+    uint32_t decelerate_after = prep_block->decelerate_after - min(lag, prep_block->decelerate_after);
+    uint32_t phase_end;
+    if (hold_state != HOLD_OFF) {
+      prep_rate = ramp_rate();
+      if (prep_rate == 0) {
+        // stopped, the ISR runs out of segments and waits
+        hold_state = HOLD_STOPPED;
+        return;
+      }
+      phase_end = prep_block->step_event_count;
+    } else if (prep_step_events < min(prep_block->accelerate_until, decelerate_after)) {
+      prep_rate = ramp_rate();
+      phase_end = min(prep_block->accelerate_until, decelerate_after);
+    } else if (prep_step_events < decelerate_after) {
+      prep_rate = prep_block->nominal_rate;
+      phase_end = decelerate_after;
+    } else {
+      if (!prep_decelerating) {
+        ramp_begin(prep_rate, prep_block->final_rate);
+        prep_decelerating = true;
+      }
+      // a ramp to rest may leave a step or two from rounding once it reached 0, these keep 
+      // the rate of its last tick instead of crawling at MINIMUM_RATE
+      prep_rate = max(ramp_rate(), (uint32_t)prep_block->rate_delta/2);
+      phase_end = prep_block->step_event_count;
+    }
+    uint32_t rate = shaped_rate(prep_rate);
+    if (rate < MINIMUM_RATE) { rate = MINIMUM_RATE; }
+    #ifdef CONFIG_STEP_TIMED_RAMPS
+      // accelerations and decelerations get timed per step by the ISR
+      bool decelerating = (prep_step_events >= prep_block->decelerate_after);
+      bool ramp = decelerating || (prep_step_events < prep_block->accelerate_until);
+      ramp = ramp && (hold_state == HOLD_OFF) && !prep_resumed;  // those ramps are timed per tick
+      bool ramp_start = (prep_step_events == 0) || (prep_step_events == prep_block->decelerate_after);
+    #endif
 
-    case TYPE_AIR_ASSIST_DISABLE:
-      control_air_assist(false);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;
+    // steps in one tick at this rate
+    prep_step_fraction += rate;
+    uint32_t step_count = prep_step_fraction / RATE_PER_SEGMENT;
+    if (step_count == 0) { step_count = 1; }
+    if (step_count > phase_end - prep_step_events) { step_count = phase_end - prep_step_events; }
+    prep_step_fraction -= step_count * RATE_PER_SEGMENT;
+    if (prep_step_fraction < 0) { prep_step_fraction = 0; }
+
+    // smooth minor axis steps of slow segments
+    uint8_t amass_level = 0;
+    #ifdef CONFIG_STEP_TIMED_RAMPS
+      if (prep_multi_axis && !ramp) {
+    #else
+      if (prep_multi_axis) {
+    #endif
+      while ((amass_level < CONFIG_AMASS_LEVELS) && ((rate << (amass_level+1)) <= AMASS_RATE)) {
+        amass_level++;
+      }
+    }
 
-    case TYPE_AUX1_ASSIST_ENABLE:
-      control_aux1_assist(true);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    segment->block = prep_block;
+    segment->step_count = step_count << amass_level;
+    segment->amass_level = amass_level;
+    segment->flags = 0;
+    if (prep_step_events == 0) { segment->flags |= SEGMENT_FIRST; }
+    prep_step_events += step_count;
+    if (prep_step_events >= prep_block->step_event_count) { segment->flags |= SEGMENT_LAST; }
+    set_segment_timer(segment, rate << amass_level);
+    set_segment_intensity(segment, rate);
+    #ifdef CONFIG_STEP_TIMED_RAMPS
+      if (ramp) {
+        segment->flags |= SEGMENT_RAMP;
+        if (ramp_start) {
+          segment->flags |= SEGMENT_RAMP_START;
+          set_segment_ramp(segment, decelerating);
+        }
+      }
+    #endif
 
-    case TYPE_AUX1_ASSIST_DISABLE:
-      control_aux1_assist(false);
-      current_block = NULL;
-      planner_discard_current_block();  
-      break;    
-
-    #ifdef DRIVEBOARD
-      case TYPE_AUX2_ASSIST_ENABLE:
-        control_aux2_assist(true);
-        current_block = NULL;
-        planner_discard_current_block();  
-        break;
-
-      case TYPE_AUX2_ASSIST_DISABLE:
-        control_aux2_assist(false);
-        current_block = NULL;
-        planner_discard_current_block();  
-        break;    
+    if (segment->flags & SEGMENT_LAST) {
+      prep_exit_speed = prep_block->nominal_speed * prep_rate / prep_block->nominal_rate;
+    }
+
+    // publish, unless a stop purged the buffer or the ISR ran dry in the meantime
+    bool starved = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (segment_buffer_flushed) {
+        // dropped, starts over on the next pass
+      } else if (segment_buffer_starved) {
+        segment_buffer_starved = false;
+        starved = true;
+      } else {
+        segment_buffer_head = next_buffer_head;
+        if (segment->flags & SEGMENT_LAST) { prep_block = NULL; }
+      }
+    }
+    if (starved) {
+      // this segment was for a moving machine, prepare it again from rest
+      prep_step_events -= step_count;
+      prep_restart_from_rest();
+    }
+  }
+}
+
+
+// The ISR ran out of segments and the axes stopped wherever the profile was. Like a feed hold 
+// that reached 0, the rest of prep_block gets replanned from rest instead of jumping back to 
+// the rate of the profile. The segment buffer is empty, prep_begin_profile() resets the shaper.
+static void prep_restart_from_rest() {
+  prep_rate = 0;
+  if (hold_state != HOLD_OFF) {
+    hold_state = HOLD_STOPPED;  // a hold gets there anyway, the resume starts at prep_rate
+  } else {
+    planner_resume_block(prep_block, prep_step_events, 0);
+    prep_begin_profile(0);
+    prep_resumed = true;
+  }
+}
+
+
+
+
+// Starts the speed profile of prep_block at step prep_step_events, going at rate. Used for a
+// new block and when the rest of a block got replanned after a feed hold.
+static void prep_begin_profile(uint32_t rate) {
+  prep_rate = rate;
+  if (segment_buffer_head == segment_buffer_tail) {
+    // starting from a standstill (or after running dry)
+    prep_step_fraction = 0;
+    shaper_reset(prep_rate);
+  }
+  if (prep_block->decelerate_after > prep_step_events + shaper_lag()) {
+    #ifdef CONFIG_S_CURVE
+      ramp_begin(rate, prep_block->peak_rate);
+    #else
+      ramp_begin(rate, prep_block->nominal_rate);
     #endif
+    prep_decelerating = false;
+  } else {
+    ramp_begin(rate, prep_block->final_rate);
+    prep_decelerating = true;
   }
-  
-  busy = false;
 }
 
 
+static uint8_t next_segment_index(uint8_t segment_index) {
+  segment_index++;
+  if (segment_index == SEGMENT_BUFFER_SIZE) { segment_index = 0; }
+  return(segment_index);
+}
+
+
+// Switches assists as attached to a block (or left pending after the last one).
+static void execute_assist_commands(uint8_t assist_on_bits, uint8_t assist_off_bits) {
+  if (assist_on_bits & ASSIST_AIR) { control_air_assist(true); }
+  if (assist_off_bits & ASSIST_AIR) { control_air_assist(false); }
+  if (assist_on_bits & ASSIST_AUX1) { control_aux1_assist(true); }
+  if (assist_off_bits & ASSIST_AUX1) { control_aux1_assist(false); }
+  #ifdef DRIVEBOARD
+    if (assist_on_bits & ASSIST_AUX2) { control_aux2_assist(true); }
+    if (assist_off_bits & ASSIST_AUX2) { control_aux2_assist(false); }
+  #endif
+}
+
+
+// Starts a speed ramp of prep_block. Its length in acceleration ticks (segments) is that of 
+// the constant slope of rate_delta, also with CONFIG_S_CURVE, so ramps cover the distance the
+// planner calculated with.
+static void ramp_begin(uint32_t start_rate, uint32_t target_rate) {
+  uint32_t rate_change;
+  if (target_rate > start_rate) { rate_change = target_rate - start_rate; }
+  else { rate_change = start_rate - target_rate; }
+  uint32_t ticks = (rate_change + prep_block->rate_delta - 1) / prep_block->rate_delta;
+  ramp_ticks = min(ticks, 0xffff);
+  ramp_tick_count = 0;
+  ramp_start_rate = start_rate;
+  ramp_target_rate = target_rate;
+}
 
 
-// This function determines an acceleration velocity change every CYCLES_PER_ACCELERATION_TICK by
-// keeping track of the number of elapsed cycles during a de/ac-celeration. The code assumes that
-// step_events occur significantly more often than the acceleration velocity iterations.
-static bool acceleration_tick() {
-  acceleration_tick_counter += cycles_per_step_event;
-  if(acceleration_tick_counter > CYCLES_PER_ACCELERATION_TICK) {
-    acceleration_tick_counter -= CYCLES_PER_ACCELERATION_TICK;
-    return true;
+// Rate in the middle of the next tick of the current ramp (midpoint rule). With CONFIG_S_CURVE
+// the smoothstep is evaluated in 12 bit fixed point, the rate span is multiplied in two halves 
+// so the intermediates fit in 32 bit for rates up to 2^24 steps/min.
+static uint32_t ramp_rate() {
+  if (ramp_tick_count < ramp_ticks) { ramp_tick_count++; }
+  else { return ramp_target_rate; }
+  uint32_t rate_span;
+  if (ramp_target_rate > ramp_start_rate) { rate_span = ramp_target_rate - ramp_start_rate; }
+  else { rate_span = ramp_start_rate - ramp_target_rate; }
+  #ifdef CONFIG_S_CURVE
+    uint32_t u = ((2*(uint32_t)ramp_tick_count - 1) << 11) / ramp_ticks;  // progress, 0..4096
+    uint32_t u2 = (u*u) >> 12;
+    uint32_t s = (u2*(3*4096L - 2*u)) >> 12;                              // 3u^2-2u^3, 0..4096
+    uint32_t rate_change = (rate_span >> 12)*s + (((rate_span & 0xfff)*s) >> 12);
+  #else
+    uint32_t rate_change = prep_block->rate_delta*ramp_tick_count - prep_block->rate_delta/2;
+    rate_change = min(rate_change, rate_span);
+  #endif
+  if (ramp_target_rate > ramp_start_rate) {
+    return ramp_start_rate + rate_change;
   } else {
-    return false;
+    return ramp_start_rate - rate_change;
   }
 }
 
 
-// Configures the prescaler and ceiling of timer 1 to produce the given rate as accurately as possible.
-// Returns the actual number of cycles per interrupt
-static uint32_t config_step_timer(uint32_t cycles) {
-  uint16_t ceiling;
-  uint16_t prescaler;
-  uint32_t actual_cycles;
+// Calculates the shaper weights from the configured resonance. Impulse i of n+1 (n=1 ZV, n=2 ZVD)
+// is delayed by i half periods and weighted binomial(n,i)*K^i/(1+K)^n. Delays that fall between
+// segments are split onto the two neighboring segments.
+static void shaper_init() {
+  #ifdef CONFIG_INPUT_SHAPER
+    double damped = sqrt(1.0 - CONFIG_SHAPER_DAMPING*CONFIG_SHAPER_DAMPING);
+    double k = exp(-CONFIG_SHAPER_DAMPING*M_PI/damped);
+    double half_period = ACCELERATION_TICKS_PER_SECOND/(2.0*CONFIG_SHAPER_FREQUENCY*damped); // (ticks)
+    double weights[SHAPER_HISTORY];
+    clear_vector_double(weights);
+    double weight = 1.0;  // binomial(n,i)*K^i
+    for (uint8_t i=0; i<=CONFIG_INPUT_SHAPER; i++) {
+      double delay = min(i*half_period, SHAPER_HISTORY-1);
+      uint8_t tick = floor(delay);
+      double fraction = delay - tick;
+      weights[tick] += weight*(1.0-fraction) / pow(1.0+k, CONFIG_INPUT_SHAPER);
+      if (tick+1 < SHAPER_HISTORY) {
+        weights[tick+1] += weight*fraction / pow(1.0+k, CONFIG_INPUT_SHAPER);
+      }
+      weight *= k*(CONFIG_INPUT_SHAPER-i)/(i+1);
+    }
+    // quantize, rounding leftovers go to the undelayed weight so the sum is exactly 1.0
+    uint16_t sum = 0;
+    for (uint8_t j=1; j<SHAPER_HISTORY; j++) {
+      shaper_weights[j] = lround(weights[j]*256);
+      sum += shaper_weights[j];
+    }
+    shaper_weights[0] = 256 - sum;
+  #endif
+}
+
+
+// Restarts the shaper at a standstill, as if the given rate had been running for a while.
+static void shaper_reset(uint32_t rate) {
+  #ifdef CONFIG_INPUT_SHAPER
+    for (uint8_t j=0; j<SHAPER_HISTORY; j++) { shaper_history[j] = rate; }
+  #endif
+}
+
+
+// Records the profile rate of a segment and returns the shaped rate.
+// Without CONFIG_INPUT_SHAPER the profile rate is passed through.
+static uint32_t shaped_rate(uint32_t rate) {
+  #ifdef CONFIG_INPUT_SHAPER
+    shaper_newest = (shaper_newest + 1) & (SHAPER_HISTORY-1);
+    shaper_history[shaper_newest] = rate;
+    // whole steps/min and their fractions summed apart, fits for rates up to 2^24 steps/min
+    uint32_t sum = 0;
+    uint32_t fraction_sum = 0;
+    for (uint8_t j=0; j<SHAPER_HISTORY; j++) {
+      if (shaper_weights[j]) {
+        uint32_t rate = shaper_history[(shaper_newest - j) & (SHAPER_HISTORY-1)];
+        sum += (rate >> 8) * shaper_weights[j];
+        fraction_sum += (rate & 0xff) * shaper_weights[j];
+      }
+    }
+    return sum + (fraction_sum >> 8);
+  #else
+    return rate;
+  #endif
+}
+
+
+// Steps the profile is ahead of the shaped rate, what the delayed impulses still owe for the
+// profile rates in the history: each past rate times the weights of the impulses yet to come.
+static uint32_t shaper_lag() {
+  #ifdef CONFIG_INPUT_SHAPER
+    uint32_t sum = 0;
+    uint32_t fraction_sum = 0;
+    uint16_t weight = 0;
+    for (uint8_t j=SHAPER_HISTORY-1; j>0; j--) {
+      weight += shaper_weights[j];
+      if (weight) {
+        uint32_t rate = shaper_history[(shaper_newest - (j-1)) & (SHAPER_HISTORY-1)];
+        sum += (rate >> 8) * weight;
+        fraction_sum += (rate & 0xff) * weight;
+      }
+    }
+    return (sum + (fraction_sum >> 8) + RATE_PER_SEGMENT/2) / RATE_PER_SEGMENT;
+  #else
+    return 0;
+  #endif
+}
+
+
+// Calculates the prescaler and ceiling of timer 1 to produce the given rate as accurately as possible.
+// The cycles per step come from the reciprocal table instead of a 32 bit division. The rate is 
+// normalized to 16 bit, its high byte indexes the table, the low byte interpolates between entries.
+// This is accurate to about 1e-4. For a Q24.8 rate the product is the cycles, plus 8 fractional
+// bits, shifted left by shift-16. Rates of at least MINIMUM_RATE make shift 13 or more.
+static void set_segment_timer(segment_t *segment, uint32_t steps_per_minute) {
+  uint32_t normalized = steps_per_minute;
+  uint8_t shift = 16;
+  while (normalized >= 0x10000L) { normalized >>= 1; shift++; }
+  while (normalized < 0x8000L) { normalized <<= 1; shift--; }
+  uint8_t index = (normalized >> 8) - 128;
+  uint8_t fraction = normalized & 0xff;
+  uint16_t reciprocal = pgm_read_word(&reciprocal_table[index]);
+  reciprocal -= ((reciprocal - pgm_read_word(&reciprocal_table[index+1])) * fraction) >> 8;
+  uint32_t product = CYCLES_PER_MINUTE_Q14 * (uint32_t)reciprocal;
+  uint32_t cycles = product >> (shift - 8);
+  uint8_t cycle_fraction;
+  if (shift >= 16) { cycle_fraction = product >> (shift - 16); }
+  else { cycle_fraction = product << (16 - shift); }
+  step_timer_setting(cycles, cycle_fraction, &segment->timer_prescaler, &segment->timer_ceiling, 
+                     &segment->timer_fraction, &segment->timer_postscaler);
+}
+
+
+// Calculates the clock select bits and ceiling of timer 1 for the given cycles per step, plus
+// the fraction of a timer tick the ISR dithers in. Timer 1 runs in CTC mode, a period lasts
+// ceiling+1 ticks. Beyond the range of the timer (about 4s per step) the step event is spread 
+// over several equal timer periods, the ISR skips all but the last (software postscaler).
+static void step_timer_setting(uint32_t cycles, uint8_t cycle_fraction, uint8_t *timer_prescaler, 
+                               uint16_t *timer_ceiling, uint8_t *timer_fraction, uint8_t *timer_postscaler) {
+  if (cycles < MINIMUM_STEP_CYCLES) {
+    // keep both phases of the step pulses CONFIG_PULSE_MICROSECONDS wide
+    cycles = MINIMUM_STEP_CYCLES;
+    cycle_fraction = 0;
+  }
+  uint32_t ticks;
+  uint8_t prescaler;
+  uint8_t tick_shift;
+  uint8_t postscaler = 0;
   if (cycles <= 0xffffL) {
-    ceiling = cycles;
+    tick_shift = 0;
     prescaler = 0; // prescaler: 0
-    actual_cycles = ceiling;
   } else if (cycles <= 0x7ffffL) {
-    ceiling = cycles >> 3;
+    tick_shift = 3;
     prescaler = 1; // prescaler: 8
-    actual_cycles = ceiling * 8L;
   } else if (cycles <= 0x3fffffL) {
-    ceiling = cycles >> 6;
+    tick_shift = 6;
     prescaler = 2; // prescaler: 64
-    actual_cycles = ceiling * 64L;
   } else if (cycles <= 0xffffffL) {
-    ceiling = (cycles >> 8);
+    tick_shift = 8;
     prescaler = 3; // prescaler: 256
-    actual_cycles = ceiling * 256L;
-  } else if (cycles <= 0x3ffffffL) {
-    ceiling = (cycles >> 10);
-    prescaler = 4; // prescaler: 1024
-    actual_cycles = ceiling * 1024L;
   } else {
-    // Okay, that was slower than we actually go. Just set the slowest speed
-    ceiling = 0xffff;
-    prescaler = 4;
-    actual_cycles = 0xffff * 1024;
+    tick_shift = 10;
+    prescaler = 4; // prescaler: 1024
   }
-  // Set prescaler
-  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | ((prescaler+1)<<CS10);
-  // Set ceiling
-  OCR1A = ceiling;
-  return(actual_cycles);
+  ticks = cycles >> tick_shift;
+  // the low byte of the cycles in 1/256 ticks, higher bits lost to the shift do not matter
+  uint8_t fraction = (((cycles << 8) | cycle_fraction) >> tick_shift);
+  if (ticks > 0x10000L) {
+    // slower than the timer goes, split into the fewest periods of the slowest prescaler
+    uint8_t periods = ((ticks-1) >> 16) + 1;  // at most 64 for 32 bit cycles
+    ticks = ticks / periods;
+    fraction = 0;
+    postscaler = periods - 1;
+  }
+  *timer_prescaler = (prescaler+1)<<CS10;
+  *timer_ceiling = ticks - 1;
+  *timer_fraction = fraction;
+  *timer_postscaler = postscaler;
 }
 
 
-static void adjust_speed( uint32_t steps_per_minute ) {
-  // steps_per_minute is typicaly just adjusted_rate
-  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
-  cycles_per_step_event = config_step_timer((CYCLES_PER_MICROSECOND*1000000*60)/steps_per_minute);
+// Calculates the laser intensity for the given rate, proportional to the speed. Uses the 
+// fixed point factor of prep_block, one 16x16 bit multiply instead of a float division.
+static void set_segment_intensity(segment_t *segment, uint32_t steps_per_minute) {
   // beam dynamics
-  uint8_t adjusted_intensity = current_block->nominal_laser_intensity * 
-                               ((float)steps_per_minute/(float)current_block->nominal_rate);
-  uint8_t constrained_intensity = max(adjusted_intensity, 0);
-  control_laser_intensity(constrained_intensity);
+  // shaped rates may briefly exceed the nominal rate of the block
+  uint16_t shifted_rate = min(steps_per_minute >> prep_rate_shift, 0xffff);
+  uint32_t adjusted_intensity = ((uint32_t)shifted_rate * prep_intensity_factor + 2048) >> 12;
+  uint8_t constrained_intensity = min(adjusted_intensity, 255);
+  segment->intensity = constrained_intensity;
 
   // depending on intensity adapt PWM freq
   // assuming: TCCR0A = _BV(COM0A1) | _BV(WGM00);  // phase correct PWM mode
   if (constrained_intensity > 40) {
     // set PWM freq to 3.9kHz
-    TCCR0B = _BV(CS01);
+    segment->pwm_prescaler = _BV(CS01);
   } else if (constrained_intensity > 10) {
     // set PWM freq to 489Hz
-    TCCR0B = _BV(CS01) | _BV(CS00);
+    segment->pwm_prescaler = _BV(CS01) | _BV(CS00);
   } else {
     // set PWM freq to 122Hz
-    TCCR0B = _BV(CS02); 
+    segment->pwm_prescaler = _BV(CS02); 
   }
 }
 
 
+#ifdef CONFIG_STEP_TIMED_RAMPS
+// Initial state of an exactly timed ramp. The step index n counts from standstill, at the
+// acceleration of the block the rate after n steps is sqrt(2*a*n). Decelerations count up
+// from -n towards standstill.
+static void set_segment_ramp(segment_t *segment, bool decelerating) {
+  double acceleration = (double)prep_block->rate_delta / RATE_SCALE 
+                        * ACCELERATION_TICKS_PER_SECOND * 60;  // (step/min^2)
+  double rate = (double)prep_block->initial_rate / RATE_SCALE;
+  if (decelerating) {
+    // rate where the deceleration starts, nominal or the peak of a block without plateau
+    double nominal_rate = (double)prep_block->nominal_rate / RATE_SCALE;
+    double peak_squared = rate*rate + 2*acceleration*prep_block->accelerate_until;
+    rate = sqrt(min(peak_squared, nominal_rate*nominal_rate));
+  }
+  int32_t n = lround(rate*rate/(2*acceleration));
+  if (n == 0) {
+    // first step from standstill, with the usual correction of the recurrence for it
+    segment->ramp_period = 0.676*sqrt(2.0/acceleration) * CYCLES_PER_MICROSECOND*1000000*60;
+  } else {
+    segment->ramp_period = (CYCLES_PER_MICROSECOND*1000000*60)/rate;
+  }
+  if (decelerating) { n = -max(n, 1); }
+  segment->ramp_n = n;
+  // the ISR loads this as the period to the first step of the ramp
+  step_timer_setting(segment->ramp_period, 0, &segment->timer_prescaler, &segment->timer_ceiling, 
+                     &segment->timer_fraction, &segment->timer_postscaler);
+}
+#endif
 
 
+// Configures the prescaler and ceiling of timer 1
+static void config_step_timer(uint8_t prescaler, uint16_t ceiling) {
+  // Set prescaler
+  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | prescaler;
+  // Set ceiling
+  OCR1A = ceiling;
+}
 
-static void homing_cycle(bool x_axis, bool y_axis, bool z_axis, bool reverse_direction, uint32_t microseconds_per_pulse) {
-  
-  uint32_t step_delay = microseconds_per_pulse - CONFIG_PULSE_MICROSECONDS;
-  uint8_t out_bits = DIRECTION_MASK;
-  uint8_t limit_bits;
-  uint8_t x_overshoot_count = 6;
-  uint8_t y_overshoot_count = 6;
-  
-  if (x_axis) { out_bits |= (1<<X_STEP_BIT); }
-  if (y_axis) { out_bits |= (1<<Y_STEP_BIT); }
-  if (z_axis) { out_bits |= (1<<Z_STEP_BIT); }
-  
-  // Invert direction bits if this is a reverse homing_cycle
-  if (reverse_direction) {
-    out_bits ^= DIRECTION_MASK;
+
+
+
+
+// Checks the switches of the current homing move, on every edge of them and once at the 
+// start of the move. Axes whose switch is reached get locked, the stepper interrupt stops them.
+static void homing_check_switches() {
+  uint8_t pressed = ~LIMIT_PIN & homing_limit_bits;
+  uint8_t reached = homing_release ? (homing_limit_bits & ~pressed) : pressed;
+  if (reached & (1<<X1_LIMIT_BIT)) { homing_locked_bits |= (1<<X_STEP_BIT); }
+  if (reached & (1<<Y1_LIMIT_BIT)) { homing_locked_bits |= (1<<Y_STEP_BIT); }
+  #ifdef CONFIG_HOMING_Z
+    if (reached & (1<<Z1_LIMIT_BIT)) { homing_locked_bits |= (1<<Z_STEP_BIT); }
+  #endif
+  homing_reached_bits |= reached;
+}
+
+// Limit switch edges come right away, not debounced, the first one counts
+void stepper_limit_edge() {
+  if (homing_limit_bits) { homing_check_switches(); }
+}
+
+
+// Latches the position of newly locked axes from the stepper interrupt. The tracer counts
+// a step when it sets it in out_bits, a step still pending there is never pulsed.
+static void homing_latch_positions(uint8_t latch_bits) {
+  if (latch_bits & (1<<X_STEP_BIT)) {
+    homing_latch[X_AXIS] = stepper_position[X_AXIS];
+    if (out_bits & (1<<X_STEP_BIT)) { homing_latch[X_AXIS] -= position_increment[X_AXIS]; }
   }
-  
-  // Apply the global invert mask
-  out_bits ^= INVERT_MASK;
-  
-  // Set direction pins
-  STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | (out_bits & DIRECTION_MASK);
-  
-  for(;;) {
-    limit_bits = LIMIT_PIN;
-    if (reverse_direction) {         
-      // Invert limit_bits if this is a reverse homing_cycle
-      limit_bits ^= LIMIT_MASK;
-    }
-    if (x_axis && !(limit_bits & (1<<X1_LIMIT_BIT))) {
-      if(x_overshoot_count == 0) {
-        x_axis = false;
-        out_bits ^= (1<<X_STEP_BIT);
-      } else {
-        x_overshoot_count--;
-      }     
-    } 
-    if (y_axis && !(limit_bits & (1<<Y1_LIMIT_BIT))) {
-      if(y_overshoot_count == 0) {
-        y_axis = false;
-        out_bits ^= (1<<Y_STEP_BIT);
-      } else {
-        y_overshoot_count--;
-      }        
-    }
-    // if (z_axis && !(limit_bits & (1<<Z1_LIMIT_BIT))) {
-    //   if(z_overshoot_count == 0) {
-    //     z_axis = false;
-    //     out_bits ^= (1<<Z_STEP_BIT);
-    //   } else {
-    //     z_overshoot_count--;
-    //   }        
-    // }
-    if(x_axis || y_axis || z_axis) {
-        // step all axes still in out_bits
-        STEPPING_PORT |= out_bits & STEPPING_MASK;
-        _delay_us(CONFIG_PULSE_MICROSECONDS);
-        STEPPING_PORT ^= out_bits & STEPPING_MASK;
-        _delay_us(step_delay);
-    } else { 
-        break;
+  if (latch_bits & (1<<Y_STEP_BIT)) {
+    homing_latch[Y_AXIS] = stepper_position[Y_AXIS];
+    if (out_bits & (1<<Y_STEP_BIT)) { homing_latch[Y_AXIS] -= position_increment[Y_AXIS]; }
+  }
+  if (latch_bits & (1<<Z_STEP_BIT)) {
+    homing_latch[Z_AXIS] = stepper_position[Z_AXIS];
+    if (out_bits & (1<<Z_STEP_BIT)) { homing_latch[Z_AXIS] -= position_increment[Z_AXIS]; }
+  }
+  homing_latched_bits |= latch_bits;
+}
+
+
+// Plans a move of the axes with a switch in limit_bits, negative distances toward the
+// switches, and runs it until all these switches are pressed (or released). The move
+// accelerates like any other and is traced by the stepper interrupt, the main loop
+// keeps preparing segments meanwhile. Returns false when the move ended otherwise.
+static bool homing_move(uint8_t limit_bits, bool release, double distance, double feed_rate) {
+  int32_t steps[3];
+  stepper_get_position_steps(steps);
+  planner_set_position_steps(steps);
+  double x = steps[X_AXIS]/CONFIG_X_STEPS_PER_MM;
+  double y = steps[Y_AXIS]/CONFIG_Y_STEPS_PER_MM;
+  double z = steps[Z_AXIS]/CONFIG_Z_STEPS_PER_MM;
+  homing_ignore_bits = 0;
+  if (limit_bits & (1<<X1_LIMIT_BIT)) { 
+    x += distance; 
+    homing_ignore_bits |= (1<<X1_LIMIT_BIT)|(1<<X2_LIMIT_BIT);
+  }
+  if (limit_bits & (1<<Y1_LIMIT_BIT)) { 
+    y += distance; 
+    homing_ignore_bits |= (1<<Y1_LIMIT_BIT)|(1<<Y2_LIMIT_BIT);
+  }
+  #ifdef CONFIG_HOMING_Z
+    if (limit_bits & (1<<Z1_LIMIT_BIT)) { 
+      z += distance; 
+      homing_ignore_bits |= (1<<Z1_LIMIT_BIT)|(1<<Z2_LIMIT_BIT);
     }
+  #endif
+  homing_release = release;
+  homing_reached_bits = 0;
+  homing_locked_bits = 0;
+  homing_latched_bits = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    homing_limit_bits = limit_bits;
+    homing_check_switches();  // switches already reached without an edge
   }
-  clear_vector(stepper_position);
-  return;
+  planner_line(x, y, z, feed_rate, 0);
+  stepper_synchronize();
+  bool reached = (homing_limit_bits == 0);
+  homing_limit_bits = 0;
+  homing_ignore_bits = 0;
+  homing_locked_bits = 0;
+  // the locked axes stood still since their switch, the tracer kept counting them
+  if (homing_latched_bits & (1<<X_STEP_BIT)) { stepper_position[X_AXIS] = homing_latch[X_AXIS]; }
+  if (homing_latched_bits & (1<<Y_STEP_BIT)) { stepper_position[Y_AXIS] = homing_latch[Y_AXIS]; }
+  if (homing_latched_bits & (1<<Z_STEP_BIT)) { stepper_position[Z_AXIS] = homing_latch[Z_AXIS]; }
+  return reached;
 }
 
-static void approach_limit_switch(bool x, bool y, bool z) {
-  homing_cycle(x, y, z,false, 600);
+
+// Homes the axes with a switch in limit_bits: back off switches already pressed, seek them 
+// fast, back off, locate them slowly and leave them again slowly, home is where they release.
+static bool homing_axes(uint8_t limit_bits) {
+  if ((~LIMIT_PIN & limit_bits) && 
+      !homing_move(limit_bits, true, CONFIG_HOMING_PULLOFF, CONFIG_HOMING_FEEDRATE)) {
+    return false;
+  }
+  return homing_move(limit_bits, false, -CONFIG_HOMING_TRAVEL, CONFIG_HOMING_SEEKRATE) &&
+         homing_move(limit_bits, true, CONFIG_HOMING_PULLOFF, CONFIG_HOMING_SEEKRATE) &&
+         homing_move(limit_bits, false, -CONFIG_HOMING_PULLOFF, CONFIG_HOMING_FEEDRATE) &&
+         homing_move(limit_bits, true, CONFIG_HOMING_PULLOFF, CONFIG_HOMING_FEEDRATE) &&
+         homing_switches_settled(limit_bits);
 }
 
-static void leave_limit_switch(bool x, bool y, bool z) {
-  homing_cycle(x, y, z, true, 10000);
+
+// The last homing move ends on the first release edge, sense_state only lets go of a switch
+// once it is stable (and bounces set it again). Outside homing moves the switches stop the
+// steppers, so the next move waits for that. False if they do not settle within 100ms.
+static bool homing_switches_settled(uint8_t limit_bits) {
+  uint8_t ms;
+  for (ms = 0; ms < 100; ms++) {
+    if (!(sense_state & limit_bits)) { return true; }
+    _delay_ms(1);
+  }
+  return false;
 }
 
-void stepper_homing_cycle() {
+
+// Returns once homed, or false after a stop or when a switch was not found. Only the serial
+// interrupt (realtime characters) and the stepper run meanwhile, lines wait until it returns.
+bool stepper_homing_cycle() {
   stepper_synchronize();  
+  planner_soft_limits(false);  // homing moves reach beyond the machine bounds
+  bool homed = true;
+  #ifdef CONFIG_HOMING_Z
+    // home the z axis first, the head is out of the way then
+    homed = homing_axes(1<<Z1_LIMIT_BIT);
+  #endif
   // home the x and y axis
-  approach_limit_switch(true, true, false);
-  leave_limit_switch(true, true, false);
+  homed = homed && homing_axes((1<<X1_LIMIT_BIT)|(1<<Y1_LIMIT_BIT));
+  if (homed) {
+    clear_vector(stepper_position);
+  } else {
+    if (!stop_requested) { stepper_request_stop(STATUS_HOMING_FAILED); }
+    // planner and parser still have the target of the aborted homing move
+    planner_request_position_update();
+    gcode_request_position_update();
+  }
+  planner_soft_limits(true);
+  return homed;
 }
-
-
@@ -39,6 +39,9 @@ void stepper_synchronize();
 // Start stepper interrupt and execute the blocks in queue.
 void stepper_wake_up();
 
+// Prepare step segments of the blocks in queue, call whenever waiting in the main loop.
+void stepper_prepare_segments();
+
 // make the stepper subsystem fall asleep
 void stepper_go_idle();
 
@@ -48,14 +51,24 @@ uint8_t stepper_stop_status();
 bool stepper_stop_requested();
 void stepper_stop_resume();
 
+// feed hold functions
+void stepper_request_hold();
+bool stepper_hold_requested();
+void stepper_hold_resume();
+
 // Get the actual position of the head in mm.
 // This is as accurate as an open loop system can be.
+// stepper_get_position_steps() takes a consistent snapshot of all axes in absolute steps.
+void stepper_get_position_steps(int32_t *steps);
 double stepper_get_position_x();
 double stepper_get_position_y();
 double stepper_get_position_z();
 void stepper_set_position(double x, double y, double z);
 
-// perform the homing cycle
-void stepper_homing_cycle();
+// perform the homing cycle, false when it failed or got stopped
+bool stepper_homing_cycle();
+
+// every edge of the limit switches, from their pin change interrupt
+void stepper_limit_edge();
 
 #endif